@@ -1,5 +1,5 @@
-/* simple memory allocation. in fact lab2 not uses page allocator (only phys
-    region reservation); so this can be further simplified.*/
+/* phys memory allocation: page allocator (buddy system), and phys region
+    reservation. */
 
 // #define K2_DEBUG_VERBOSE
 // #define K2_DEBUG_INFO
@@ -8,66 +8,610 @@
 #include "plat.h"
 #include "utils.h"
 #include "spinlock.h"
+#include "list.h"
+#include "sched.h"
 
 
 /* Phys memory layout:	cf paging_init() below. 
 
-	Upon init, the Rpi3 hw (GPU) will allocate framebuffer at certain addr. We
-	need to know that addr in order to decide paging memory usable to the
-	kernel. However, we won't know that addr until we initialize the GPU (cf
-	mbox.c). Based on my observation, GPU always allocates the framebuffer at
-	fixed locations ("GUESS_FB_BASE_PA" below) near the end of phys mem. 
-
-	Based on the observation, we exclude GUESS_FB_BASE_PA--HIGH_MEMORY from the
-	paging memory. (Hope we don't waste too much phys mem)
-
-	If later the GPU init code (mbox.c) finds these assumption is wrong, 
-	mem reservation will fail and kernel will panic. 
-*/
-
-/* qemu always set to 0x3c100000 (a safe choice, I suppose?); the rpi3 hw will
-	change based on the requested fb size, e.g. 0x3e8fa000 for 1024x768;
-	0x3e7fe000 for 1360x768... so pick "one size fits all" */
-#define GUESS_FB_BASE_PA 0x3c100000
-#define HIGH_MEMORY0 GUESS_FB_BASE_PA // the actual "highmem"
-
-/* "mem_map" are flags covering from LOW_MEMORY to HIGH_MEMORY, including: 
-(1) region for page allocator 
-(2) the possible framebuffer region (to be reserved).
-(3) the malloc region (to be reserved).
-one byte for a page. 1=allocated */
+	Upon init, the Rpi3 hw (GPU) will allocate framebuffer at certain addr,
+	which we won't know until we initialize the GPU (cf mbox.c). Observed: 
+	qemu always picks 0x3c100000; the rpi3 hw picks based on the requested fb
+	size, e.g. 0x3e8fa000 for 1024x768; 0x3e7fe000 for 1360x768... i.e.
+	near the end of phys mem.
+
+	So the end of phys mem, CMA_BASE--HIGH_MEMORY, is a "contiguous memory
+	area" (CMA, after linux): 
+	- the framebuffer is claimed from it, wherever the GPU puts it
+	(cma_claim()), and given back to the page allocator on fb_fini(). 
+	- DMA users get physically contiguous buffers from it (cma_alloc()).
+	- when not claimed, its pages are free pages like any other, but on
+	separate free lists, lent out only for unzeroed single pages
+	(get_free_page_nozero()) and only once the rest of memory runs out, so
+	that claims are unlikely to find them in use.
+	A claim that finds a page in use fails (and the fb init panics), as
+	before; but no memory is set aside on a guess.
+	The malloc region (cf slab.c) sits right below CMA_BASE. */
+
+/* must be aligned to the largest buddy block, so that no block straddles */
+#define CMA_BASE	0x3c000000UL
+_Static_assert(!(CMA_BASE & ((PAGE_SIZE << (MAX_ORDER-1)) - 1)));
+
+/* Page allocator: binary buddy system. 
+
+	Free memory is kept as blocks of 2^order pages (order < MAX_ORDER), each
+	aligned to its size in *physical* address, on per-order free lists.
+	Allocation takes a block of the smallest sufficient order and splits it
+	in halves as needed; freeing merges a block with its "buddy" (the other
+	half of the parent block, pfn ^ (1<<order)) as long as the buddy is free.
+	Both are O(MAX_ORDER) = O(log n), independent of how full memory is.
+
+	The free list links live in the free pages themselves: the kernel maps
+	all of phys memory 1:1 (the identity map, cf mm.c), so a pa is usable 
+	as a pointer. No extra metadata per free page is needed besides 
+	mem_map[] below. */
+
+/* "mem_map": one byte per phys page, from PHYS_BASE to HIGH_MEMORY.
+	PG_FREE|order: the first page of a free block of 2^order pages
+	PG_RSVD: reserved by reserve_phys_region() (e.g. framebuffer, malloc)
+	0: allocated, inside a free block (not the 1st page), or not managed 
+
+	Free lists are per zone: normal pages, and CMA pages (cf above) */
+#define PG_FREE		0x80
+#define PG_RSVD		0x40
 static unsigned char mem_map [ MAX_PAGING_PAGES ] = {0,}; 
-unsigned paging_pages_used = 0, paging_pages_total = 0;
+unsigned paging_pages_total = 0;
+
+struct free_area {
+	struct list_head list; 		// free blocks of this order. links in the pages
+	unsigned long nr_free; 		// # of blocks on the list
+};
+#define ZONE_NORMAL	0
+#define ZONE_CMA	1
+#define NR_ZONES	2
+static struct free_area free_area[NR_ZONES][MAX_ORDER]; 
 
-/*  Minimalist page allocation 
-	all alloc/free funcs below are locked (SMP safe) */
+/*  all alloc/free funcs below are locked (SMP safe). alloc_lock protects
+	the buddy lists and mem_map */
 struct spinlock alloc_lock = {.locked=0, .cpu=0, .name="alloc_lock"}; 
 
 static unsigned long LOW_MEMORY = 0; 	// pa
 static unsigned long PAGING_PAGES = 0; 
 extern char kernel_end; // linker.ld
 
+// pages managed by the buddy allocator: [start_pfn, end_pfn). 
+// [cma_start_pfn, end_pfn) is the CMA zone
+static unsigned long start_pfn, end_pfn, cma_start_pfn; 
+
+#define pa_to_pfn(pa)	(((pa) - PHYS_BASE) >> PAGE_SHIFT)
+#define pfn_to_pa(pfn)	(((unsigned long)(pfn) << PAGE_SHIFT) + PHYS_BASE)
+#define pfn_to_list(pfn)	((struct list_head *)pfn_to_pa(pfn))
+#define list_to_pfn(l)	pa_to_pfn((unsigned long)(l))
+
+static inline int is_buddy_pfn(unsigned long pfn) {
+	return pfn >= start_pfn && pfn < end_pfn; 
+}
+
+static inline int pfn_zone(unsigned long pfn) {
+	return pfn >= cma_start_pfn ? ZONE_CMA : ZONE_NORMAL; 
+}
+
+/* below: caller must hold alloc_lock */
+static void add_free_block(unsigned long pfn, unsigned order) {
+	struct free_area *area = &free_area[pfn_zone(pfn)][order]; 
+	mem_map[pfn] = PG_FREE | order; 
+	list_add(pfn_to_list(pfn), &area->list); 
+	area->nr_free++; 
+}
+
+static void del_free_block(unsigned long pfn, unsigned order) {
+	mem_map[pfn] = 0; 
+	list_del(pfn_to_list(pfn)); 
+	free_area[pfn_zone(pfn)][order].nr_free--; 
+}
+
+/* return the pfn of the allocated block. (unsigned long)-1 if none */
+static unsigned long __alloc_pages_zone(unsigned order, int zone) {
+	struct free_area *area = free_area[zone]; 
+	unsigned o; 
+	unsigned long pfn; 
+
+	for (o = order; o < MAX_ORDER; o++)
+		if (!list_empty(&area[o].list))
+			break; 
+	if (o == MAX_ORDER)
+		return (unsigned long)-1; 
+
+	pfn = list_to_pfn(area[o].list.next); 
+	del_free_block(pfn, o); 
+	while (o > order) { 	// split. return the upper halves 
+		o--; 
+		add_free_block(pfn + (1UL << o), o); 
+	}
+	return pfn; 
+}
+
+/* from normal memory */
+static inline unsigned long __alloc_pages(unsigned order) {
+	return __alloc_pages_zone(order, ZONE_NORMAL); 
+}
+
+static void __free_pages(unsigned long pfn, unsigned order) {
+	unsigned long buddy; 
+
+	while (order < MAX_ORDER - 1) {
+		buddy = pfn ^ (1UL << order); 
+		if (!is_buddy_pfn(buddy) || mem_map[buddy] != (PG_FREE | order))
+			break; 
+		del_free_block(buddy, order); 	// coalesce 
+		pfn &= ~(1UL << order); 
+		order++; 
+	}
+	add_free_block(pfn, order); 
+}
+
+/* find the free block containing @pfn. return its first pfn and set *order.
+(unsigned long)-1 if @pfn is not free, w/ *order set to MAX_ORDER */
+static unsigned long find_free_block(unsigned long pfn, unsigned *order) {
+	unsigned long head; 
+	for (unsigned o = 0; o < MAX_ORDER; o++) {
+		head = pfn & ~((1UL << o) - 1); 
+		if (is_buddy_pfn(head) && mem_map[head] == (PG_FREE | o))
+			{*order = o; return head;}
+	}
+	*order = MAX_ORDER; 
+	return (unsigned long)-1; 
+}
+
+/* take a single free page @pfn out of its free block. the rest of the block
+goes back to the free lists as smaller blocks */
+static void carve_page(unsigned long pfn) {
+	unsigned o; 
+	unsigned long head = find_free_block(pfn, &o), half; 
+
+	BUG_ON(head == (unsigned long)-1); 
+	del_free_block(head, o); 
+	while (o > 0) {
+		o--; 
+		half = 1UL << o; 
+		if (pfn >= head + half) {
+			add_free_block(head, o); 
+			head += half; 
+		} else 
+			add_free_block(head + half, o); 
+	}
+}
+
+/* Per-CPU page caches, in front of the buddy allocator (order-0 only).
+
+	Most allocations are single pages. Each cpu keeps a list of free pages
+	that it can hand out, or take back, without alloc_lock; the list is
+	refilled from (drained to) the buddy allocator @batch pages at a time,
+	i.e. one alloc_lock round trip per batch.
+	 - hot/cold: recently freed pages are likely still in the cache, so
+	 free_page() puts them at the head of the list, where allocations are
+	 taken from. Pages that are known to be cache-cold (e.g. after DMA, or
+	 freshly refilled from the buddy lists) go to the tail, which is also
+	 where draining takes pages from.
+	 - watermarks: refill when the list drops to @low; drain once it grows
+	 above @high. Tunable via pcp_set_watermarks().
+	The pcp lock is only contended by drain_all_pages(). 
+
+	Page usage is counted per cpu too (one cpu may free what another has
+	allocated, so a single counter may go negative); nr_pages_used() sums. 
+
+	Zero pool: each cpu also keeps up to @zhigh pages that are already
+	zero filled. The idle loop (kernel_main()) refills it, one page at a
+	time, instead of just waiting for irqs; get_free_page() then only pops
+	a page off the pool. Callers that overwrite the whole page anyway use
+	get_free_page_nozero() and leave zeroed pages to those who need them. */
+struct per_cpu_pages {
+	struct spinlock lock; 
+	struct list_head list; 	// free pages. hot at head, cold at tail
+	int count; 				// # of pages on the list
+	int low, high, batch; 	// watermarks, cf above
+	long used; 				// pages in use, accounted to this cpu
+	struct list_head zlist; // zero filled pages
+	int zcount, zhigh; 		// # of pages on zlist, and target
+} __cacheline_aligned;
+static struct per_cpu_pages pcps[NCPU]; 
+
+static void colour_drain(void); 
+
+/* caller must hold pcp->lock. return # of pages moved */
+static int pcp_refill(struct per_cpu_pages *pcp) {
+	unsigned long pfn; 
+	int i; 
+
+	acquire(&alloc_lock); 
+	for (i = 0; i < pcp->batch; i++) {
+		if ((pfn = __alloc_pages(0)) == (unsigned long)-1)
+			break; 
+		list_add_tail(pfn_to_list(pfn), &pcp->list); 	// cold 
+	}
+	release(&alloc_lock); 
+	pcp->count += i; 
+	return i; 
+}
+
+/* give back (up to) @n pages from the cold end. caller must hold pcp->lock */
+static void pcp_drain(struct per_cpu_pages *pcp, int n) {
+	struct list_head *l; 
+
+	acquire(&alloc_lock); 
+	while (n-- > 0 && !list_empty(&pcp->list)) {
+		l = pcp->list.prev; 
+		list_del(l); 
+		__free_pages(list_to_pfn(l), 0); 
+		pcp->count--; 
+	}
+	release(&alloc_lock); 
+}
+
+/* return all cached pages to the buddy allocator, e.g. before reserving a
+phys region. caller MUST NOT hold alloc_lock */
+void drain_all_pages(void) {
+	struct list_head *l; 
+
+	colour_drain(); 	// pages sitting in colour bins, too
+
+	for (int i = 0; i < NCPU; i++) {
+		struct per_cpu_pages *pcp = &pcps[i]; 
+		acquire(&pcp->lock); 
+		while (!list_empty(&pcp->zlist)) { 	// zeroing is wasted. so be it
+			l = pcp->zlist.next; 
+			list_del(l); 
+			list_add(l, &pcp->list); 
+			pcp->zcount--; 
+			pcp->count++; 
+		}
+		pcp_drain(pcp, pcp->count); 
+		release(&pcp->lock); 
+	}
+}
+
+/* tune the watermarks of all cpus. return 0 on success */
+int pcp_set_watermarks(int low, int high, int batch) {
+	if (low < 0 || batch <= 0 || high < low + batch)
+		{W("bad watermarks low %d high %d batch %d", low, high, batch); return -1;}
+	for (int i = 0; i < NCPU; i++) {
+		struct per_cpu_pages *pcp = &pcps[i]; 
+		acquire(&pcp->lock); 
+		pcp->low = low; pcp->high = high; pcp->batch = batch; 
+		if (pcp->count > high)
+			pcp_drain(pcp, pcp->count - high); 
+		release(&pcp->lock); 
+	}
+	return 0; 
+}
+
+static unsigned long pcp_alloc_page(int cold) {
+	struct per_cpu_pages *pcp; 
+	struct list_head *l = 0; 
+
+	push_off(); 	// stay on this cpu 
+	pcp = &pcps[cpuid()]; 
+	acquire(&pcp->lock); 
+	if (pcp->count <= pcp->low)
+		pcp_refill(pcp); 
+	if (!list_empty(&pcp->list)) {
+		l = cold ? pcp->list.prev : pcp->list.next; 
+		list_del(l); 
+		pcp->count--; 
+		pcp->used++; 
+	}
+	release(&pcp->lock); 
+	pop_off(); 
+	return (unsigned long)l; 
+}
+
+/* account @n pages (may be negative) to this cpu */
+static void pages_used_add(long n) {
+	push_off(); 
+	__atomic_add_fetch(&pcps[cpuid()].used, n, __ATOMIC_RELAXED); 
+	pop_off(); 
+}
+
+static void pcp_free_page(unsigned long p, int cold) {
+	struct per_cpu_pages *pcp; 
+
+	BUG_ON((p & ~PAGE_MASK) || !is_buddy_pfn(pa_to_pfn(p))); 
+	/* a CMA page lent out (e.g. by get_free_page_nozero()) goes straight
+	back: cached per cpu, it could be handed out for long-lived use and 
+	then block cma_claim()/cma_alloc() */
+	if (pfn_zone(pa_to_pfn(p)) == ZONE_CMA) {
+		acquire(&alloc_lock); 
+		__free_pages(pa_to_pfn(p), 0); 
+		release(&alloc_lock); 
+		pages_used_add(-1); 
+		return; 
+	}
+	push_off(); 
+	pcp = &pcps[cpuid()]; 
+	acquire(&pcp->lock); 
+	if (cold)
+		list_add_tail((struct list_head *)p, &pcp->list); 
+	else
+		list_add((struct list_head *)p, &pcp->list); 
+	pcp->count++; 
+	pcp->used--; 
+	if (pcp->count > pcp->high)
+		pcp_drain(pcp, pcp->batch); 
+	release(&pcp->lock); 
+	pop_off(); 
+}
+
+/* # of pages in use (allocated or reserved), summed over all cpus */
+unsigned long nr_pages_used(void) {
+	long sum = 0; 
+	for (int i = 0; i < NCPU; i++)
+		sum += __atomic_load_n(&pcps[i].used, __ATOMIC_RELAXED); 
+	return sum; 
+}
+
+/* allocate 2^order physically contiguous pages (NOT zero filled).
+return pa of the first page. 0 if failed */
+unsigned long alloc_pages(unsigned order) {
+	unsigned long pfn; 
+
+	if (order == 0)
+		return pcp_alloc_page(0); 
+	if (order >= MAX_ORDER)
+		return 0; 
+	acquire(&alloc_lock);
+	pfn = __alloc_pages(order); 
+	release(&alloc_lock);
+	if (pfn == (unsigned long)-1)
+		return 0; 
+	pages_used_add(1L << order); 
+	return pfn_to_pa(pfn); 
+}
+
+/* free pages from alloc_pages(). @order must match the allocation */
+void free_pages(unsigned long p, unsigned order) {
+	unsigned long pfn = pa_to_pfn(p); 
+
+	if (order == 0)
+		{pcp_free_page(p, 0); return;}
+	BUG_ON((p & ~PAGE_MASK) || order >= MAX_ORDER || !is_buddy_pfn(pfn)
+		|| (pfn & ((1UL << order) - 1))); 
+	acquire(&alloc_lock);
+	__free_pages(pfn, order); 
+	release(&alloc_lock);
+	pages_used_add(-(1L << order)); 
+}
+
+/* Page colouring (optional, off by default).
+
+	The L2 is physically indexed: a page can only occupy the sets picked
+	by pa bits [12, 12 + log2(NR_PAGE_COLOURS)), its "colour". Pages of
+	different colours never compete for L2 lines. Pages from the buddy or
+	per-cpu lists come in no particular colour order, so tasks that are hot
+	at the same time may pile on the same sets (conflict misses) while
+	others sit idle.
+
+	With colouring on, a task whose ->colours mask is non-zero gets its
+	pages (get_free_page() & _nozero()) only in those colours, round robin,
+	i.e. it is confined to a slice of L2 (a "cache partition") that other
+	tasks w/ disjoint masks cannot evict. Children inherit the mask.
+
+	Free pages are binned by colour. A bin is refilled w/ an aligned block
+	of NR_PAGE_COLOURS pages from the buddy allocator, which has exactly one
+	page of each colour; pages that overflow their bin (COLOUR_BIN_HIGH) go
+	back to the buddy lists. Coloured pages are freed as usual (free_page()). 
+	Tasks w/o a mask are unaffected. */
+#define COLOUR_ORDER	3
+_Static_assert((1 << COLOUR_ORDER) == NR_PAGE_COLOURS); 
+#define pfn_colour(pfn) 	((pfn) & (NR_PAGE_COLOURS - 1))
+
+struct colour_bin {
+	struct list_head list; 	// free pages of this colour
+	int count; 
+}; 
+static struct colour_bin colour_bins[NR_PAGE_COLOURS]; 
+static struct spinlock colour_lock = {.locked=0, .cpu=0, .name="colour_lock"}; 
+int page_colouring = 0; 	// on/off, cf set_page_colouring()
+
+/* caller holds colour_lock. return 0 if out of memory */
+static int colour_refill(void) {
+	unsigned long pfn, p; 
+	struct colour_bin *bin; 
+
+	acquire(&alloc_lock); 
+	if ((pfn = __alloc_pages(COLOUR_ORDER)) == (unsigned long)-1) {
+		release(&alloc_lock); 
+		return 0; 
+	}
+	for (p = pfn; p < pfn + NR_PAGE_COLOURS; p++) {
+		bin = &colour_bins[pfn_colour(p)]; 
+		if (bin->count >= COLOUR_BIN_HIGH)
+			__free_pages(p, 0); 
+		else {
+			list_add_tail(pfn_to_list(p), &bin->list); 
+			bin->count++; 
+		}
+	}
+	release(&alloc_lock); 
+	return 1; 
+}
+
+/* a page of one of the colours in @mask, per the cursor @next. 0 if failed */
+static unsigned long alloc_page_coloured(unsigned mask, unsigned *next) {
+	struct colour_bin *bin; 
+	struct list_head *l = 0; 
+	unsigned c; 
+
+	mask &= (1U << NR_PAGE_COLOURS) - 1; 
+	if (!mask)
+		return alloc_pages(0); 
+	c = *next; 
+	do 
+		c = (c + 1) % NR_PAGE_COLOURS; 
+	while (!(mask & (1U << c))); 
+	*next = c; 
+
+	bin = &colour_bins[c]; 
+	acquire(&colour_lock); 
+	if (list_empty(&bin->list))
+		colour_refill(); 
+	if (!list_empty(&bin->list)) {
+		l = bin->list.next; 
+		list_del(l); 
+		bin->count--; 
+	}
+	release(&colour_lock); 
+	if (l)
+		pages_used_add(1); 
+	return (unsigned long)l; 
+}
+
+/* the current task's colours, if it is confined. 0 otherwise */
+static unsigned task_colours(void) {
+	struct task_struct *p; 
+	unsigned mask = 0; 
+
+	if (!page_colouring)
+		return 0; 
+	push_off(); 
+	p = mycpu()->proc; 
+	if (p)
+		mask = p->colours; 
+	pop_off(); 
+	return mask; 
+}
+
+static unsigned long task_alloc_page_coloured(unsigned mask) {
+	unsigned long page; 
+	push_off(); 	// ->colour_next is the task's own. no preemption in between
+	page = alloc_page_coloured(mask, &mycpu()->proc->colour_next); 
+	pop_off(); 
+	return page; 
+}
+
+/* the bins go back to the buddy allocator */
+static void colour_drain(void) {
+	struct list_head *l; 
+
+	acquire(&colour_lock); 
+	acquire(&alloc_lock); 
+	for (int c = 0; c < NR_PAGE_COLOURS; c++) 
+		while (!list_empty(&colour_bins[c].list)) {
+			l = colour_bins[c].list.next; 
+			list_del(l); 
+			__free_pages(list_to_pfn(l), 0); 
+			colour_bins[c].count--; 
+		}
+	release(&alloc_lock); 
+	release(&colour_lock); 
+}
+
+/* turn colouring on/off */
+void set_page_colouring(int on) {
+	page_colouring = on; 
+	if (!on)
+		colour_drain(); 
+}
+
+/* confine @p's future page allocations to the colours in @mask (0: any) */
+void set_task_colours(struct task_struct *p, unsigned mask) {
+	p->colours = mask & ((1U << NR_PAGE_COLOURS) - 1); 
+}
+
+unsigned page_colour(unsigned long pa) {
+	return pfn_colour(pa_to_pfn(pa)); 
+}
+
 /* allocate a page (zero filled). return pa of the page. 0 if failed */
 unsigned long get_free_page() {
-	acquire(&alloc_lock);
-	for (int i = 0; i < PAGING_PAGES-MALLOC_PAGES; i++){
-		if (mem_map[i] == 0){
-			mem_map[i] = 1; paging_pages_used++;
-			release(&alloc_lock);
-			unsigned long page = LOW_MEMORY + i*PAGE_SIZE;
+	struct per_cpu_pages *pcp; 
+	struct list_head *l = 0; 
+	unsigned long page; 
+	unsigned mask = task_colours(); 
+
+	if (mask) { 	// the zero pool is not binned: zero it ourselves
+		page = task_alloc_page_coloured(mask); 
+		if (page)
 			memzero_aligned((void *)page, PAGE_SIZE);
-			return page;
-		}
+		return page; 
 	}
-	release(&alloc_lock);
-	return 0;
+
+	push_off(); 
+	pcp = &pcps[cpuid()]; 
+	acquire(&pcp->lock); 
+	if (!list_empty(&pcp->zlist)) {
+		l = pcp->zlist.next; 
+		list_del(l); 		// also zeros the link, i.e. the page is all 0 now
+		pcp->zcount--; 
+		pcp->used++; 
+	}
+	release(&pcp->lock); 
+	pop_off(); 
+	if (l)
+		return (unsigned long)l; 
+
+	// pool is empty: zero it ourselves
+	page = alloc_pages(0); 
+	if (page)
+		memzero_aligned((void *)page, PAGE_SIZE);
+	return page;
+}
+
+/* allocate a page, contents undefined. for callers that will overwrite it.
+may borrow a CMA page when normal memory runs out */
+unsigned long get_free_page_nozero(void) {
+	unsigned mask = task_colours(); 
+	unsigned long page = mask ? task_alloc_page_coloured(mask) : alloc_pages(0), pfn; 
+
+	if (page)
+		return page; 
+	acquire(&alloc_lock); 
+	pfn = __alloc_pages_zone(0, ZONE_CMA); 
+	release(&alloc_lock); 
+	if (pfn == (unsigned long)-1)
+		return 0; 
+	pages_used_add(1); 
+	return pfn_to_pa(pfn); 
+}
+
+/* zero one page into this cpu's zero pool, if below target. 
+called from the idle loop with irq on. return 1 if a page is zeroed */
+int zero_pool_refill(void) {
+	struct per_cpu_pages *pcp; 
+	unsigned long page; 
+	int full; 
+
+	push_off(); 
+	pcp = &pcps[cpuid()]; 
+	full = (__atomic_load_n(&pcp->zcount, __ATOMIC_RELAXED) >= pcp->zhigh); 
+	pop_off(); 
+	// a cold page: zeroing would evict whatever of it is in the cache anyway
+	if (full || !(page = pcp_alloc_page(1)))
+		return 0; 
+	/* still free, only in flight to the pool: not in use, even while we 
+	are preempted below (e.g. idle runs after every sleep()) */
+	pages_used_add(-1); 
+
+	memzero_aligned((void *)page, PAGE_SIZE); 	// no lock. may be preempted
+
+	push_off(); 
+	pcp = &pcps[cpuid()]; 
+	acquire(&pcp->lock); 
+	list_add_tail((struct list_head *)page, &pcp->zlist); 
+	pcp->zcount++; 
+	release(&pcp->lock); 
+	pop_off(); 
+	return 1; 
 }
 
 /* free a page. @p is pa of the page. */
 void free_page(unsigned long p){
-	acquire(&alloc_lock);
-	mem_map[(p - LOW_MEMORY)>>PAGE_SHIFT] = 0; paging_pages_used--;
-	release(&alloc_lock);
+	pcp_free_page(p, 0); 
+}
+
+/* free a page whose contents are unlikely in cpu cache (e.g. written by DMA,
+or not touched for long). it will be reused last */
+void free_page_cold(unsigned long p){
+	pcp_free_page(p, 1); 
 }
 
 /* reserve a phys region. all pages must be unused previously. 
@@ -76,20 +620,38 @@ void free_page(unsigned long p){
 	return 0 if OK  */
 static int _reserve_phys_region(unsigned long pa_start, 
 	unsigned long size, int is_reserve) {
+	unsigned long pfn, pfn0, pfn1; 
+	unsigned o; 
+
 	if ((pa_start & ~PAGE_MASK) != 0 || (size & ~PAGE_MASK) != 0) // must align
 		{W("pa_start %lx size %lx", pa_start, size);BUG(); return -1;}
+	if (pa_start < PHYS_BASE || pa_start + size > HIGH_MEMORY)
+		{W("pa_start %lx size %lx", pa_start, size); return -1;}
 
-	for (unsigned i = ((pa_start-LOW_MEMORY)>>PAGE_SHIFT); 
-			i<((pa_start-LOW_MEMORY+size)>>PAGE_SHIFT); i++){
-		if (mem_map[i] == is_reserve)	
-			{return -2;}      // page already reserved / freed? 
+	pfn0 = pa_to_pfn(pa_start); 
+	pfn1 = pa_to_pfn(pa_start + size); 
+
+	for (pfn = pfn0; pfn < pfn1; pfn++) {
+		if (is_reserve) { 	// must be free (in buddy) or unmanaged & unreserved
+			if (mem_map[pfn] == PG_RSVD || (is_buddy_pfn(pfn) 
+					&& find_free_block(pfn, &o) == (unsigned long)-1))
+				{return -2;}      // page already reserved/allocated
+		} else if (mem_map[pfn] != PG_RSVD)
+				{return -2;}      // page not reserved
 	}	
-	for (unsigned i = ((pa_start-LOW_MEMORY)>>PAGE_SHIFT); 
-		i<((pa_start-LOW_MEMORY+size)>>PAGE_SHIFT); i++){
-		mem_map[i] = is_reserve; 
+	for (pfn = pfn0; pfn < pfn1; pfn++) {
+		if (is_reserve) {
+			if (is_buddy_pfn(pfn))
+				carve_page(pfn); 
+			mem_map[pfn] = PG_RSVD; 
+		} else {
+			mem_map[pfn] = 0; 
+			if (is_buddy_pfn(pfn))
+				__free_pages(pfn, 0); 
+		}
 	}
-	if (is_reserve) paging_pages_used += (size>>PAGE_SHIFT); 
-		else paging_pages_used -= (size>>PAGE_SHIFT);
+	if (is_reserve) pages_used_add(size>>PAGE_SHIFT); 
+		else pages_used_add(-(long)(size>>PAGE_SHIFT));
 
 	I("%s: %s. pa_start %lx -- %lx size %lx",
 		 __func__, is_reserve?"reserved":"freed", 
@@ -103,6 +665,12 @@ int reserve_phys_region(unsigned long pa_start, unsigned long size) {
 	acquire(&alloc_lock); 
 	ret = _reserve_phys_region(pa_start, size, 1/*reserve*/);
 	release(&alloc_lock); 
+	if (ret == -2) { 	// some pages may be sitting in per-cpu caches
+		drain_all_pages(); 
+		acquire(&alloc_lock); 
+		ret = _reserve_phys_region(pa_start, size, 1/*reserve*/);
+		release(&alloc_lock); 
+	}
 	return ret; 
 }
 
@@ -115,37 +683,140 @@ int free_phys_region(unsigned long pa_start, unsigned long size) {
 	return ret; 
 }
 
+/* -------------  CMA  -------------------- */
+
+/* allocate @size bytes of physically contiguous memory (page aligned, thus
+also cache line aligned) from CMA, e.g. for DMA. NOT zeroed. 
+return pa, 0 on failure */
+unsigned long cma_alloc(unsigned long size) {
+	unsigned long npages = PGROUNDUP(size) >> PAGE_SHIFT, pfn; 
+	unsigned order = 0; 
+
+	while ((1UL << order) < npages)
+		order++; 
+	if (!size || order >= MAX_ORDER)
+		{W("bad size %lx", size); return 0;}
+
+	acquire(&alloc_lock); 
+	pfn = __alloc_pages_zone(order, ZONE_CMA); 
+	if (pfn != (unsigned long)-1) 	// give back the tail beyond @size
+		for (unsigned long i = npages; i < (1UL << order); i++)
+			__free_pages(pfn + i, 0); 
+	release(&alloc_lock); 
+	if (pfn == (unsigned long)-1)
+		{W("out of CMA. size %lx", size); return 0;}
+	pages_used_add(npages); 
+	return pfn_to_pa(pfn); 
+}
+
+/* free memory from cma_alloc(). @size must match */
+void cma_free(unsigned long pa, unsigned long size) {
+	unsigned long pfn = pa_to_pfn(pa), npages = PGROUNDUP(size) >> PAGE_SHIFT; 
+
+	BUG_ON((pa & ~PAGE_MASK) || pfn < cma_start_pfn || pfn + npages > end_pfn); 
+	acquire(&alloc_lock); 
+	for (unsigned long i = 0; i < npages; i++)
+		__free_pages(pfn + i, 0); 
+	release(&alloc_lock); 
+	pages_used_add(-(long)npages); 
+}
+
+/* claim a region chosen by someone else (e.g. the GPU's framebuffer). 
+normally in CMA, but any free pages will do. return 0 on success */
+int cma_claim(unsigned long pa, unsigned long size) {
+	if (pa < CMA_BASE || pa + size > HIGH_MEMORY)
+		W("claim %lx--%lx outside CMA %lx--%lx", pa, pa + size, 
+			CMA_BASE, (unsigned long)HIGH_MEMORY); 
+	return reserve_phys_region(pa, size); 
+}
+
+/* the claimed region goes back to the page allocator */
+int cma_release(unsigned long pa, unsigned long size) {
+	return free_phys_region(pa, size); 
+}
+
+/* print # of free blocks per order. for debugging */
+void buddy_dump(void) {
+	for (int z = 0; z < NR_ZONES; z++) {
+		printf("%s free blocks (order:count)", z == ZONE_CMA ? "cma" : "buddy");
+		for (int o = 0; o < MAX_ORDER; o++)
+			printf(" %d:%lu", o, free_area[z][o].nr_free); 
+		printf("\n"); 
+	}
+	for (int i = 0; i < NCPU; i++)
+		printf("cpu%d pcp: count %d low %d high %d batch %d used %ld zeroed %d/%d\n", 
+			i, pcps[i].count, pcps[i].low, pcps[i].high, pcps[i].batch, 
+			pcps[i].used, pcps[i].zcount, pcps[i].zhigh); 
+	if (page_colouring) {
+		printf("colour bins:"); 
+		for (int c = 0; c < NR_PAGE_COLOURS; c++)
+			printf(" %d", colour_bins[c].count); 
+		printf("\n"); 
+	}
+}
+
 /* init kernel's memory mgmt 
 	return: # of paging pages */
 unsigned int paging_init() {
+	unsigned long malloc_base = CMA_BASE - MALLOC_PAGES * PAGE_SIZE; 
+
 	LOW_MEMORY = PGROUNDUP((unsigned long)&kernel_end);
-	PAGING_PAGES = (HIGH_MEMORY0 - LOW_MEMORY) / PAGE_SIZE; // comment above
+	PAGING_PAGES = (HIGH_MEMORY - LOW_MEMORY) / PAGE_SIZE; // comment above
 	
+	BUG_ON(LOW_MEMORY >= malloc_base); 
     BUG_ON(2 * MALLOC_PAGES >= PAGING_PAGES); // too many malloc pages 
 
+	/* hand all paging memory to the buddy allocator, as the largest blocks
+	that are naturally aligned */
+	for (int z = 0; z < NR_ZONES; z++)
+		for (int o = 0; o < MAX_ORDER; o++)
+			INIT_LIST_HEAD(&free_area[z][o].list); 
+	for (int i = 0; i < NCPU; i++) {
+		initlock(&pcps[i].lock, "pcp"); 
+		INIT_LIST_HEAD(&pcps[i].list); 
+		pcps[i].count = 0; pcps[i].used = 0; 
+		pcps[i].low = PCP_LOW; pcps[i].high = PCP_HIGH; 
+		pcps[i].batch = PCP_BATCH; 
+		INIT_LIST_HEAD(&pcps[i].zlist); 
+		pcps[i].zcount = 0; pcps[i].zhigh = ZERO_POOL_HIGH; 
+	}
+	for (int c = 0; c < NR_PAGE_COLOURS; c++) {
+		INIT_LIST_HEAD(&colour_bins[c].list); 
+		colour_bins[c].count = 0; 
+	}
+	start_pfn = pa_to_pfn(LOW_MEMORY); 
+	end_pfn = pa_to_pfn(HIGH_MEMORY); 
+	cma_start_pfn = pa_to_pfn(CMA_BASE); 
+	for (unsigned long pfn = start_pfn, o; pfn < end_pfn; pfn += (1UL << o)) {
+		for (o = MAX_ORDER - 1; o > 0; o--)
+			if (!(pfn & ((1UL << o) - 1)) && pfn + (1UL << o) <= end_pfn)
+				break; 
+		add_free_block(pfn, o); 
+	}
+
     /* reserve a virtually contig region for malloc()  */
     if (MALLOC_PAGES) {
         acquire(&alloc_lock); 
-		int ret = _reserve_phys_region(HIGH_MEMORY0-MALLOC_PAGES*PAGE_SIZE, 
-			MALLOC_PAGES*PAGE_SIZE, 1); 
+		int ret = _reserve_phys_region(malloc_base, MALLOC_PAGES*PAGE_SIZE, 1); 
         BUG_ON(ret); 
         release(&alloc_lock);
+        kmem_init(malloc_base, MALLOC_PAGES); // slab.c
     }
 
 	printf("phys mem: %08x -- %08x\n", PHYS_BASE, PHYS_BASE + PHYS_SIZE);
 	printf("\t kernel: %08x -- %08lx\n", KERNEL_START, (unsigned long)(&kernel_end));
-	printf("\t paging mem: %08lx -- %08x\n", LOW_MEMORY, HIGH_MEMORY0-(MALLOC_PAGES<<PAGE_SHIFT));
-	printf("\t\t %lu%s %ld pages\n", 
-		int_val((HIGH_MEMORY0 - LOW_MEMORY)),
-		int_postfix((HIGH_MEMORY0 - LOW_MEMORY)),
+	printf("\t paging mem: %08lx -- %08lx\n", LOW_MEMORY, malloc_base);
+	printf("\t\t %lu%s %ld pages (incl. cma)\n", 
+		int_val((HIGH_MEMORY - LOW_MEMORY)),
+		int_postfix((HIGH_MEMORY - LOW_MEMORY)),
 		PAGING_PAGES);
-    printf("\t malloc mem: %08x -- %08x\n", HIGH_MEMORY0-(MALLOC_PAGES<<PAGE_SHIFT), HIGH_MEMORY0);
+    printf("\t malloc mem: %08lx -- %08lx\n", malloc_base, CMA_BASE);
 	printf("\t\t %lu%s\n", int_val(MALLOC_PAGES * PAGE_SIZE),
                                  int_postfix(MALLOC_PAGES * PAGE_SIZE)); 
-	printf("\t reserved for framebuffer: %08x -- %08x\n", 
-		HIGH_MEMORY0, HIGH_MEMORY);
+	printf("\t cma (framebuffer, dma): %08lx -- %08x\n", 
+		CMA_BASE, HIGH_MEMORY);
 
-	paging_pages_total = ((HIGH_MEMORY0-LOW_MEMORY)>>PAGE_SHIFT) - MALLOC_PAGES; 
+	paging_pages_total = ((HIGH_MEMORY-LOW_MEMORY)>>PAGE_SHIFT) - MALLOC_PAGES; 
 
 	return PAGING_PAGES; 
 }
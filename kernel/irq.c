@@ -29,7 +29,7 @@ void enable_interrupt_controller(int coreid)
 {
 #if defined(PLAT_RPI3) || defined(PLAT_RPI3QEMU)
     // On RPi3, Arm Generic timer IRQs are wired to a per-core interrupt controller/register. 
-    // For core 0, this is `TIMER_INT_CTRL_0` at 0x40000040; bit 1 is for physical timer at EL1 (CNTP). This register is documented 
+    // For core 0, this is `TIMER_INT_CTRL_0` at 0x40000040; bit 1 is for physical timer at EL1 (CNTP), bit 3 for the virtual timer (CNTV). This register is documented 
     // in the [manual](https://www.raspberrypi.org/documentation/hardware/raspberrypi/bcm2836/QA7_rev3.4.pdf) of BCM2836 
     // (search for "Core timers interrupts"). Note the manual is NOT for the BCM2837 SoC used by Rpi3    
     put32(TIMER_INT_CTRL_0 + 4*coreid, TIMER_INT_CTRL_0_VALUE);
@@ -38,8 +38,7 @@ void enable_interrupt_controller(int coreid)
         put32(ENABLE_IRQS_1, 
                     ENABLE_IRQS_1_USB |\
                     ENABLE_IRQS_1_AUX | \
-                    ENABLE_IRQS_1_DMA(12) |\
-                    SYSTEM_TIMER_IRQ_1); 
+                    ENABLE_IRQS_1_DMA(12)); 
 
 #elif defined(PLAT_VIRT)
     arm_gic_dist_init(0 /* core */, VA_START + QEMU_GIC_DIST_BASE, 0 /*irq start*/);
@@ -83,13 +82,14 @@ void handle_irq(void) {
         handle_generic_timer_irq();
         irq &= (~GENERIC_TIMER_INTERRUPT);
     } 
+
+    if (irq & GENERIC_VTIMER_INTERRUPT) {     // vtimers of this core
+        generic_vtimer_irq();
+        irq &= (~GENERIC_VTIMER_INTERRUPT);
+    } 
     
     if (irq & GPU_SIDE_INTERRUPT) {
         unsigned int p1 = get32(IRQ_PENDING_1);
-        if (p1 & SYSTEM_TIMER_IRQ_1) {
-            sys_timer_irq(); 
-            p1 &= (~SYSTEM_TIMER_IRQ_1);
-        }
         if (p1) {
             E("unknown pending irq in IRQ_PENDING_1 p1 %08x", p1); 
             goto unknown; 
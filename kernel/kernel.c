@@ -10,11 +10,25 @@
 
 // unittests.c
 extern void test_ktimer(); 
+extern void test_wtimer(); 
+extern void test_ptimer(); 
+extern void test_ktime(); 
+extern void test_sched_tick(); 
+extern void test_timer_bench(); 
 extern void test_fb(); 
 extern void test_kern_tasks_print(); 
 extern void test_kern_tasks_donut(); 
 extern void test_kern_task_mgmt(); 
 extern void test_kern_reader_writer(); 
+extern void test_kern_sync(); 
+extern void test_ring(); 
+extern void test_msgchan(); 
+extern void test_rcu(); 
+extern void test_buddy(); 
+extern void test_slab(); 
+extern void test_kmem_cache(); 
+extern void test_asid(); 
+extern void test_page_colouring(); 
 extern void donut(int x, int y); 	//donut.c
 extern void donut_canvas_init(void); //donut.c
 extern void test_kern_tasks_donut(void);
@@ -23,14 +37,18 @@ struct cpu cpus[NCPU];
 
 // Q3: quest "two preemptive printers"
 void kernel_main() {
+	mmu_init(); 	// MMU & caches on. identity map
 	uart_init();
 	init_printf(NULL, putc);	
 	printf("------ kernel boot ------  core %d\n\r", cpuid());
 	printf("build time (kernel.c) %s %s\n", __DATE__, __TIME__); // simplicity 
 			
 	paging_init(); 
+	pipe_init(); 	// typed object caches. after paging_init()
+	msgchan_init(); 
+	mm_init(); 		// address spaces
 	sched_init(); 	// must be before schedule() or timertick() 
-	fb_init(); 		// reserve fb memory other page allocations
+	fb_init(); 		// claim fb memory (cma) before other page allocations
 	sys_timer_init(); 		// kernel timer: delay, timekeeping...
 	enable_interrupt_controller(0/*coreid*/);
 	/* turn on cpu irq  */
@@ -51,7 +69,10 @@ void kernel_main() {
         /* don't call schedule(), otherwise each irq calls schedule(): too much
         instead, let timer_tick() throttle & decide when to call schedule() */
         V("idle task");
-        asm volatile("wfi");
+        /* spare cycles: pre-zero pages for get_free_page(). wait for irq
+        only when there's nothing left to do */
+        if (!zero_pool_refill())
+            asm volatile("wfi");
     }
 }
 
@@ -0,0 +1,58 @@
+// Circular doubly linked lists, embedded in the objects they link.
+// A (much) trimmed down version of linux's include/linux/list.h
+
+#ifndef LIST_H
+#define LIST_H
+
+struct list_head {
+  struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+  list->next = list;
+  list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+                              struct list_head *next) {
+  next->prev = new;
+  new->next = next;
+  new->prev = prev;
+  prev->next = new;
+}
+
+/* add @new right after @head (stack) */
+static inline void list_add(struct list_head *new, struct list_head *head) {
+  __list_add(new, head, head->next);
+}
+
+/* add @new right before @head, i.e. at the tail (queue) */
+static inline void list_add_tail(struct list_head *new, struct list_head *head) {
+  __list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry) {
+  entry->next->prev = entry->prev;
+  entry->prev->next = entry->next;
+  entry->next = entry->prev = 0;
+}
+
+static inline int list_empty(const struct list_head *head) {
+  return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) list_entry((ptr)->prev, type, member)
+
+#define list_for_each(pos, head) \
+  for (pos = (head)->next; pos != (head); pos = pos->next)
+
+/* safe against removal of @pos */
+#define list_for_each_safe(pos, n, head) \
+  for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
+
+#endif
@@ -335,12 +335,19 @@ static int do_fb_init(struct fb_struct *fbs)
     }
     release(&mboxlock); 
 
-    if (reserve_phys_region(mbox[28], fbs->size)) {
-        E("failed to reserve fb mem. pa 0x%x size 0x%x already in use.",
+    // the GPU has picked the address. claim the pages from the page allocator
+    if (cma_claim(mbox[28], fbs->size)) {
+        E("failed to claim fb mem. pa 0x%x size 0x%x already in use.",
             mbox[28], fbs->size); BUG(); 
         return -1; 
-    } else 
-        return 0; 
+    }
+    /* write-combining: pixel stores reach memory (the GPU) w/o any cache 
+    flush, at store buffer speed */
+    if (set_memory_wc(mbox[28], fbs->size)) {
+        E("failed to map fb write-combining"); BUG(); 
+        return -1; 
+    }
+    return 0; 
 }
 
 void fb_showpicture();
@@ -385,7 +392,10 @@ int fb_fini(void) {
         I("failed to rls fb with GPU (could be benign)"); 
         // response code always 0x80000001 (failure). couldn't figure out why
 
-    if (free_phys_region((unsigned long)the_fb.fb, the_fb.size)) {
+    // the fb memory goes back to the page allocator, cacheable again
+    if (set_memory_wb((unsigned long)the_fb.fb, the_fb.size))
+        E("failed to map fb memory back. bug?"); 
+    if (cma_release((unsigned long)the_fb.fb, the_fb.size)) {
         E("failed to free fb memory. bug?"); 
         ret = -2; 
     }
@@ -489,7 +499,7 @@ void fb_showpicture()
     char res[16]; 
     sprintf(res, " %dx%d", the_fb.width, the_fb.height); // debug info 
     fb_print(&x, &y, res);
-    // __asm_flush_dcache_range(the_fb.fb, the_fb.fb + the_fb.size); 
+    // fb is write-combining (cf do_fb_init()): no cache flush needed
 }
 
 /*
@@ -0,0 +1,400 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    Kernel page tables & MMU.
+
+    Boot runs with MMU and caches off, so every load/store goes to DRAM. 
+    mmu_init() builds an identity (va == pa) map of the kernel's view of
+    phys mem and turns on the MMU, D-cache and I-cache:
+    - RAM, 0 -- DEVICE_BASE: normal memory, write-back cacheable, inner
+      shareable, as 2MB blocks (no level 3 tables at all)
+    - peripherals, DEVICE_BASE -- 0x40000000: device-nGnRE, 2MB blocks
+    - local peripherals (ARM timers, core irq ctrl) at 0x40000000: one 1GB
+      device-nGnRE block
+    So the whole kernel needs ~500 2MB TLB entries at most, and the hot set
+    (kernel image, stacks, a few pages) a handful.
+
+    Since va == pa, nothing else in the kernel has to change. Memory that
+    others (GPU) read/write behind the cpu's back must now be cleaned/
+    invalidated explicitly, cf mbox_call(). The exception is the
+    framebuffer: set_memory_wc() remaps it as normal non-cacheable, i.e.
+    write-combining: pixel stores are merged in the write buffer and go
+    straight to memory, so the GPU always sees them and no cache
+    maintenance is needed. For that, the 2MB blocks covering it are split
+    into level 3 tables (4KB pages) on demand.
+
+    Address spaces. Each mm_struct has its own level 1 table, which shares
+    the kernel's entries (global mappings, the 1st 2GB) and maps user va
+    [USER_VA_START, USER_VA_END) w/ 4KB pages, non-global, i.e. tagged in the
+    TLB w/ the mm's ASID. So a switch between address spaces is a write to
+    ttbr0 (pgd | asid<<48), w/o any TLB flush; the kernel's TLB entries
+    survive all switches.
+
+    ASIDs are 8 bits (0 is the kernel's, init_mm). They are handed out
+    lazily at switch_mm(), in generations: mm->context = generation | asid.
+    Once a generation runs out of ASIDs, the allocator bumps the generation
+    and starts over from an empty bitmap, except the ASIDs currently live
+    on cpus, which are kept (reserved); every cpu flushes its TLB once,
+    at its next switch_mm(). An mm whose context is from an older
+    generation gets a new ASID (its old one, if still free) at its next
+    switch_mm(). So the whole-TLB flushes happen only once every ~255 new
+    address spaces; unmap/teardown flush by ASID or by (ASID, va) only.
+*/
+
+#include "plat.h"
+#include "utils.h"
+#include "mmu.h"
+#include "sched.h"
+#include "slab.h"
+
+// level 1: 4 entries x 1GB. level 2: 512 entries x 2MB for the 1st GB
+static unsigned long pg_dir[PTRS_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));
+static unsigned long pg_pmd[PTRS_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));
+
+/* must be called first thing at boot, before any other memory is touched
+with the cache on (or off) assumption */
+void mmu_init(void) {
+    unsigned long pa;
+
+    for (int i = 0; i < PTRS_PER_TABLE; i++) {
+        pa = (unsigned long)i << PMD_SHIFT;
+        pg_pmd[i] = pa | (pa >= DEVICE_BASE ? MMU_DEVICE_FLAGS : MMU_FLAGS);
+    }
+    pg_dir[0] = (unsigned long)pg_pmd | MM_TYPE_TABLE;
+    pg_dir[1] = DEVICE_LOW | MMU_DEVICE_FLAGS;     // 1GB block
+
+    enable_mmu((unsigned long)pg_dir);     // boot.S
+}
+
+/* replace the 2MB block mapping @pa with a level 3 table, w/ the same
+attributes per page. return the table, or 0 on failure. caller has irq off */
+static unsigned long *split_block(unsigned long pa) {
+    int i = pa >> PMD_SHIFT;
+    unsigned long blk = pg_pmd[i], *pte;
+
+    if ((blk & 3) == MM_TYPE_TABLE)
+        return (unsigned long *)(blk & MM_ADDR_MASK);
+    if (!(pte = (unsigned long *)get_free_page()))     // for good
+        return 0;
+    for (int j = 0; j < PTRS_PER_TABLE; j++)
+        pte[j] = ((blk & ~3UL) | MM_TYPE_PAGE) + ((unsigned long)j << PAGE_SHIFT);
+    // break-before-make: no TLB may hold the block & the pages at once
+    pg_pmd[i] = 0;
+    flush_tlb_all();
+    pg_pmd[i] = (unsigned long)pte | MM_TYPE_TABLE;
+    asm volatile("dsb ishst; isb" ::: "memory");
+    return pte;
+}
+
+/* change the memory type of the kernel's (identity) map of [pa, pa+size)
+to @mt, one of MT_xxx. page aligned, normal memory below DEVICE_BASE only.
+return 0 on success */
+static int set_memory_type(unsigned long pa, unsigned long size, int mt) {
+    unsigned long end = pa + size, a, *pte;
+
+    BUG_ON((pa | size) & (PAGE_SIZE - 1));
+    BUG_ON(end > DEVICE_BASE);
+
+    push_off();
+    for (a = pa; a < end; a += (1UL << PMD_SHIFT) - (a & ((1UL << PMD_SHIFT) - 1)))
+        if (!split_block(a)) {
+            pop_off();
+            return -1;
+        }
+    /* break-before-make again, as the memory type changes. no one touches
+    the range meanwhile: it is being handed to/back from a device */
+    for (a = pa; a < end; a += PAGE_SIZE) {
+        pte = (unsigned long *)(pg_pmd[a >> PMD_SHIFT] & MM_ADDR_MASK);
+        pte[(a >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1)] &= ~(unsigned long)MM_TYPE_PAGE;
+    }
+    flush_tlb_all();
+    for (a = pa; a < end; a += PAGE_SIZE) {
+        pte = (unsigned long *)(pg_pmd[a >> PMD_SHIFT] & MM_ADDR_MASK);
+        pte += (a >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1);
+        *pte = (*pte & ~MM_ATTRINDX_MASK) | MM_ATTRINDX(mt) | MM_TYPE_PAGE;
+    }
+    asm volatile("dsb ishst; isb" ::: "memory");
+    pop_off();
+    return 0;
+}
+
+/* map [pa, pa+size) write-combining (normal non-cacheable), e.g. for a
+framebuffer. cached copies are written back & dropped once the new entries
+are in: until the break, the cacheable mapping is live and speculative 
+refills may bring lines back. maintenance by va works through the 
+non-cacheable mapping */
+int set_memory_wc(unsigned long pa, unsigned long size) {
+    if (set_memory_type(pa, size, MT_NORMAL_NC))
+        return -1;
+    __asm_flush_dcache_range((void *)pa, (void *)(pa + size));
+    return 0;
+}
+
+/* back to normal write-back cacheable, e.g. after the device is done. 
+non-cacheable accesses never allocate, but drop any line anyway before 
+the range goes back to the allocator: stale ones would shadow what the 
+device wrote. invalidate only, as nothing cached may be newer */
+int set_memory_wb(unsigned long pa, unsigned long size) {
+    __asm_invalidate_dcache_range((void *)pa, (void *)(pa + size));
+    return set_memory_type(pa, size, MT_NORMAL);
+}
+
+/* ------------------------- ASIDs ------------------------------- */
+
+#define NUM_ASIDS           (1UL << ASID_BITS)
+#define ASID_MASK           (NUM_ASIDS - 1)
+#define ASID_FIRST_VERSION  NUM_ASIDS
+#define asid_of(ctx)        ((ctx) & ASID_MASK)
+
+static struct spinlock asid_lock = {.locked=0, .cpu=0, .name="asid_lock"};
+static unsigned long asid_generation = ASID_FIRST_VERSION;
+static unsigned long asid_map[NUM_ASIDS / 64];     // ASIDs in use in the current generation
+static unsigned long cur_idx = 1;                  // where the next search starts
+static unsigned long active_asids[NCPU];           // context live on each cpu
+static unsigned long reserved_asids[NCPU];         // ditto, at the last rollover
+static int tlb_flush_pending[NCPU];
+unsigned long asid_rollovers;                      // stats
+
+struct mm_struct init_mm;  // the kernel's: pg_dir, asid 0
+static struct kmem_cache *mm_cache;
+
+static inline int asid_test(unsigned long asid) {
+    return (asid_map[asid / 64] >> (asid % 64)) & 1;
+}
+static inline void asid_set(unsigned long asid) {
+    asid_map[asid / 64] |= 1UL << (asid % 64);
+}
+
+/* new generation. keep what is live on cpus, as those cannot be changed
+under their feet; all cpus flush their TLBs before using any new ASID.
+caller holds asid_lock */
+static void flush_context(void) {
+    unsigned long asid;
+
+    memzero(asid_map, sizeof(asid_map));
+    asid_set(0);
+    for (int i = 0; i < NCPU; i++) {
+        asid = active_asids[i];
+        /* a cpu w/o an active asid since the last rollover keeps the one 
+        it had reserved back then */
+        if (asid == 0)
+            asid = reserved_asids[i];
+        asid_set(asid_of(asid));
+        reserved_asids[i] = asid;
+        tlb_flush_pending[i] = 1;
+    }
+    cur_idx = 1;
+    asid_rollovers++;
+}
+
+/* a context (generation | asid) for @mm in the current generation.
+caller holds asid_lock */
+static unsigned long new_context(struct mm_struct *mm) {
+    unsigned long ctx = mm->context, asid = asid_of(ctx);
+
+    if (ctx) {
+        // live on some cpu at the last rollover: keep it, w/ new generation
+        for (int i = 0; i < NCPU; i++)
+            if (reserved_asids[i] == ctx)
+                return (reserved_asids[i] = asid_generation | asid);
+        // still free in the current generation: reuse it
+        if (!asid_test(asid)) {
+            asid_set(asid);
+            return asid_generation | asid;
+        }
+    }
+
+    for (asid = cur_idx; asid < NUM_ASIDS && asid_test(asid); asid++)
+        ;
+    if (asid == NUM_ASIDS) {    // out of asids: start a new generation
+        asid_generation += ASID_FIRST_VERSION;
+        flush_context();
+        for (asid = 1; asid_test(asid); asid++)     // at most NCPU taken
+            ;
+    }
+    asid_set(asid);
+    cur_idx = asid + 1;
+    return asid_generation | asid;
+}
+
+/* load @mm to ttbr0 on this cpu. called from switch_to() w/ sched_lock 
+held (irq off) */
+void switch_mm(struct mm_struct *mm) {
+    int cpu = cpuid();
+    unsigned long ctx;
+
+    acquire(&asid_lock);
+    ctx = mm->context;
+    if (mm != &init_mm && (ctx & ~ASID_MASK) != asid_generation)
+        mm->context = ctx = new_context(mm);
+    if (tlb_flush_pending[cpu]) {
+        tlb_flush_pending[cpu] = 0;
+        local_flush_tlb_all();
+    }
+    active_asids[cpu] = ctx;
+    release(&asid_lock);
+
+    set_pgd(mm->pgd | (asid_of(ctx) << TTBR_ASID_SHIFT));   // utils.S
+    mycpu()->active_mm = mm;
+}
+
+/* ------------------------- address spaces ---------------------- */
+
+static void mm_ctor(void *obj) {
+    struct mm_struct *mm = obj;
+    initlock(&mm->lock, "mm");
+}
+
+void mm_init(void) {
+    init_mm.ref = 1;
+    init_mm.pgd = (unsigned long)pg_dir;
+    init_mm.context = 0;    // asid 0, never handed out
+    initlock(&init_mm.lock, "init_mm");
+    for (int i = 0; i < NCPU; i++)
+        cpus[i].active_mm = &init_mm;
+
+    mm_cache = kmem_cache_create("mm_struct", sizeof(struct mm_struct), 0,
+        mm_ctor, 0);
+    BUG_ON(!mm_cache);
+}
+
+static unsigned long mm_get_kernel_page(struct mm_struct *mm) {
+    unsigned long page;
+
+    if (mm->kernel_pages_count == MAX_TASK_KER_PAGES)
+        return 0;
+    if (!(page = get_free_page()))  // zeroed: all entries invalid
+        return 0;
+    mm->kernel_pages[mm->kernel_pages_count++] = page;
+    return page;
+}
+
+/* a new address space w/ the kernel mapped and no user pages. ref=1.
+return 0 on failure */
+struct mm_struct *mm_alloc(void) {
+    struct mm_struct *mm;
+    unsigned long *pgd;
+
+    if (!(mm = kmem_cache_alloc(mm_cache)))
+        return 0;
+    // lock: already constructed
+    mm->ref = 1;
+    mm->context = 0;    // no asid until the 1st switch_mm()
+    mm->sz = mm->codesz = 0;
+    mm->user_pages_count = mm->kernel_pages_count = 0;
+
+    if (!(pgd = (unsigned long *)mm_get_kernel_page(mm))) {
+        kmem_cache_free(mm_cache, mm);
+        return 0;
+    }
+    for (int i = 0; i < PTRS_PER_PUD; i++)     // kernel: global entries
+        pgd[i] = pg_dir[i];
+    mm->pgd = (unsigned long)pgd;
+    return mm;
+}
+
+/* next level table for @va from the entry @tbl[@idx], allocated if none */
+static unsigned long *walk_next(struct mm_struct *mm, unsigned long *tbl, int idx) {
+    unsigned long next;
+
+    if (!(tbl[idx] & MM_TYPE_TABLE)) {
+        if (!(next = mm_get_kernel_page(mm)))
+            return 0;
+        tbl[idx] = next | MM_TYPE_TABLE;
+    }
+    return (unsigned long *)(tbl[idx] & MM_ADDR_MASK);
+}
+
+/* map user @va (page aligned) to phys page @pa in @mm. return 0 on success */
+int map_user_page(struct mm_struct *mm, unsigned long va, unsigned long pa) {
+    unsigned long *pmd, *pte, old;
+    int idx;
+
+    BUG_ON(va < USER_VA_START || va >= USER_VA_END || (va & (PAGE_SIZE - 1)));
+
+    acquire(&mm->lock);
+    if (!(pmd = walk_next(mm, (unsigned long *)mm->pgd, va >> PUD_SHIFT)) ||
+        !(pte = walk_next(mm, pmd, (va >> PMD_SHIFT) & (PTRS_PER_TABLE - 1)))) {
+        release(&mm->lock);
+        return -1;
+    }
+    idx = (va >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1);
+    old = pte[idx];
+    pte[idx] = pa | MMU_PTE_FLAGS;
+    if (old && mm->context)     // remap: only this page of this mm is stale
+        flush_tlb_page(asid_of(mm->context), va);
+    else                        // new entry: nothing in the TLB to flush
+        asm volatile("dsb ishst" ::: "memory");
+    release(&mm->lock);
+    return 0;
+}
+
+/* a fresh page, mapped at user @va in @mm. return its pa, or 0 on failure */
+unsigned long alloc_user_page(struct mm_struct *mm, unsigned long va) {
+    unsigned long page;
+
+    if (mm->user_pages_count == MAX_TASK_USER_PAGES)
+        return 0;
+    if (!(page = get_free_page()))
+        return 0;
+    if (map_user_page(mm, va, page) < 0) {
+        free_page(page);
+        return 0;
+    }
+    mm->user_pages[mm->user_pages_count].phys_addr = page;
+    mm->user_pages[mm->user_pages_count].virt_addr = va;
+    mm->user_pages_count++;
+    return page;
+}
+
+/* drop a ref of @mm. the last one frees the page tables, user pages, and
+the mm itself. its TLB entries are flushed by ASID; the asid is simply 
+left to age out w/ its generation */
+void mm_release(struct mm_struct *mm) {
+    if (__atomic_sub_fetch(&mm->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    BUG_ON(mm == &init_mm);
+
+    push_off();
+    if (mycpu()->active_mm == mm)   // lazily kept by a kernel task
+        switch_mm(&init_mm);
+    pop_off();
+
+    acquire(&asid_lock);
+    if (asid_generation == (mm->context & ~ASID_MASK))
+        flush_tlb_asid(asid_of(mm->context));
+    release(&asid_lock);
+
+    for (int i = 0; i < mm->user_pages_count; i++)
+        free_page(mm->user_pages[i].phys_addr);
+    for (int i = 0; i < mm->kernel_pages_count; i++)
+        free_page(mm->kernel_pages[i]);
+    mm->user_pages_count = mm->kernel_pages_count = 0;
+    kmem_cache_free(mm_cache, mm);  // still constructed
+}
+
+/* let the current (kernel) task run in @mm's address space, e.g. to access
+its user pages. switch_to() reloads it whenever the task is switched in */
+void use_mm(struct mm_struct *mm) {
+    struct task_struct *p = myproc();
+
+    __atomic_add_fetch(&mm->ref, 1, __ATOMIC_RELAXED);
+    push_off();
+    p->mm = mm;
+    switch_mm(mm);
+    pop_off();
+}
+
+/* undo use_mm(). the cpu keeps @mm in ttbr0 (lazily) until the next task
+w/ a different mm is switched in, or @mm is released */
+void unuse_mm(struct mm_struct *mm) {
+    struct task_struct *p = myproc();
+
+    push_off();
+    BUG_ON(p->mm != mm);
+    p->mm = 0;
+    pop_off();
+    mm_release(mm);
+}
@@ -0,0 +1,109 @@
+// MMU: translation table formats and system register values. cf mm.c
+// included by both .c and .S
+
+#ifndef _MMU_H
+#define _MMU_H
+
+#include "plat.h"
+
+#ifdef __ASSEMBLER__
+#define _UL(x)      x
+#else
+#define _UL(x)      x##UL
+#endif
+
+/* Translation: 4KB granule, 32-bit VA (T0SZ=32) via TTBR0, so a walk starts
+  at level 1, whose table has 4 entries of 1GB each. A level 2 table has
+  512 entries of 2MB each. Kernel va == pa (identity map). 
+
+  The kernel's entries (global, the 1st 2GB) are in every address space's
+  level 1 table; user va is the 3rd GB, mapped with 4KB pages tagged with
+  the address space's ASID (8 bits, in TTBR0[55:48]). cf mm.c */
+#define VA_BITS             32
+#define PTRS_PER_TABLE      (1 << TABLE_SHIFT)
+#define PUD_SHIFT           SUPERSECTION_SHIFT      // L1 entry: 1GB
+#define PMD_SHIFT           SECTION_SHIFT           // L2 entry: 2MB
+#define PTRS_PER_PUD        (1 << (VA_BITS - PUD_SHIFT))
+#define MM_ADDR_MASK        (((_UL(1) << 48) - 1) & ~(PAGE_SIZE - 1))  // output address
+#define USER_VA_START       (_UL(2) << PUD_SHIFT)
+#define USER_VA_END         (_UL(3) << PUD_SHIFT)
+
+#define ASID_BITS           8
+#define TTBR_ASID_SHIFT     48
+
+// descriptor types, bits[1:0]
+#define MM_TYPE_BLOCK       0x1
+#define MM_TYPE_TABLE       0x3
+#define MM_TYPE_PAGE        0x3     // at level 3
+
+// lower attributes of block/page descriptors
+#define MM_ATTRINDX(i)      ((i) << 2)      // index into MAIR_EL1
+#define MM_ATTRINDX_MASK    MM_ATTRINDX(7)
+#define MM_AP_EL1_RW        (0 << 6)        // EL0: no access
+#define MM_AP_RW            (1 << 6)        // EL1 & EL0: read/write
+#define MM_SH_INNER         (3 << 8)        // inner shareable
+#define MM_ACCESS           (1 << 10)       // AF. no access flag fault
+#define MM_NG               (1 << 11)       // not global: tagged with ASID
+// upper attributes
+#define MM_PXN              (_UL(1) << 53)     // EL1 execute never
+#define MM_UXN              (_UL(1) << 54)     // EL0 execute never
+
+/* memory types, i.e. indices to MAIR_EL1 */
+#define MT_DEVICE_nGnRE         0
+#define MT_NORMAL               1
+#define MT_NORMAL_NC            2
+#define MT_DEVICE_nGnRE_FLAGS   0x04
+#define MT_NORMAL_FLAGS         0xff    // inner/outer write-back, r/w-allocate
+#define MT_NORMAL_NC_FLAGS      0x44    // inner/outer non-cacheable: write-combining
+#define MAIR_VALUE  ((MT_DEVICE_nGnRE_FLAGS << (8 * MT_DEVICE_nGnRE)) | \
+                     (MT_NORMAL_FLAGS << (8 * MT_NORMAL)) | \
+                     (MT_NORMAL_NC_FLAGS << (8 * MT_NORMAL_NC)))
+
+// user pages: EL0/EL1 read/write, never executed by the kernel
+#define MMU_PTE_FLAGS       (MM_TYPE_PAGE | MM_ATTRINDX(MT_NORMAL) | \
+                             MM_SH_INNER | MM_ACCESS | MM_NG | MM_AP_RW | MM_PXN)
+
+// kernel mappings: RAM, and peripherals (never executed)
+#define MMU_FLAGS           (MM_TYPE_BLOCK | MM_ATTRINDX(MT_NORMAL) | \
+                             MM_SH_INNER | MM_ACCESS | MM_AP_EL1_RW)
+#define MMU_DEVICE_FLAGS    (MM_TYPE_BLOCK | MM_ATTRINDX(MT_DEVICE_nGnRE) | \
+                             MM_ACCESS | MM_AP_EL1_RW | MM_PXN | MM_UXN)
+
+/* TCR_EL1: TTBR0 walks with cacheable, inner shareable table accesses;
+  TTBR1 walks disabled (no kernel va in the upper half); 4GB phys.
+  A1=0, AS=0: 8-bit ASID taken from TTBR0 */
+#define TCR_T0SZ            (64 - VA_BITS)
+#define TCR_IRGN0_WBWA      (1 << 8)
+#define TCR_ORGN0_WBWA      (1 << 10)
+#define TCR_SH0_INNER       (3 << 12)
+#define TCR_TG0_4K          (0 << 14)
+#define TCR_EPD1            (1 << 23)
+#define TCR_IPS_4GB         (_UL(0) << 32)
+#define TCR_VALUE           (TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | \
+                             TCR_SH0_INNER | TCR_TG0_4K | TCR_EPD1 | TCR_IPS_4GB)
+
+#ifndef __ASSEMBLER__
+/* TLB maintenance. "is": broadcast to all cores in the inner shareable
+domain. the dsb before: page table updates are visible to the walker */
+static inline void flush_tlb_all(void) {
+    asm volatile("dsb ishst; tlbi vmalle1is; dsb ish; isb" ::: "memory");
+}
+
+static inline void local_flush_tlb_all(void) {
+    asm volatile("dsb nshst; tlbi vmalle1; dsb nsh; isb" ::: "memory");
+}
+
+/* all (non-global) entries of one address space */
+static inline void flush_tlb_asid(unsigned long asid) {
+    asm volatile("dsb ishst; tlbi aside1is, %0; dsb ish"
+        :: "r" (asid << TTBR_ASID_SHIFT) : "memory");
+}
+
+/* one page of one address space */
+static inline void flush_tlb_page(unsigned long asid, unsigned long va) {
+    asm volatile("dsb ishst; tlbi vae1is, %0; dsb ish"
+        :: "r" ((va >> PAGE_SHIFT) | (asid << TTBR_ASID_SHIFT)) : "memory");
+}
+#endif
+
+#endif
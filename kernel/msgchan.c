@@ -0,0 +1,143 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    Message channels: zero-copy IPC between kernel tasks.
+
+    A sender donates a whole page (from get_free_page()) to the channel; a
+    receiver takes the page out and owns it from then on (and eventually
+    calls free_page()). Only the page's pa is queued, so a large buffer,
+    e.g. a rendered frame or a file block, moves between pipeline stages
+    at the cost of passing a pointer. The sender must not touch the page
+    after a successful send.
+
+    The queue is bounded (@depth), which also throttles a fast producer.
+    Like pipe.c, senders/receivers are woken up only on full->non-full and
+    empty->non-empty transitions.
+
+    send/recv can be blocking, non-blocking (polling), or timed (in ms).
+
+    Channels come from a typed slab cache, constructed once (cf pipe.c).
+*/
+
+#include "plat.h"
+#include "utils.h"
+#include "slab.h"
+#include "msgchan.h"
+
+static struct kmem_cache *msgchan_cache;
+
+static void msgchan_ctor(void *obj) {
+    struct msgchan *ch = obj;
+    initlock(&ch->lock, "msgchan");
+    cv_init(&ch->notempty, "msg-notempty");
+    cv_init(&ch->notfull, "msg-notfull");
+    ch->head = ch->tail = 0;
+}
+
+void msgchan_init(void) {
+    msgchan_cache = kmem_cache_create("msgchan", sizeof(struct msgchan), 0,
+        msgchan_ctor, SLAB_COLOUR);
+    BUG_ON(!msgchan_cache);
+}
+
+/* create a channel holding at most @depth messages. return 0 on failure */
+struct msgchan *msgchan_alloc(unsigned depth) {
+    struct msgchan *ch;
+
+    if (!depth || depth > MSGCHAN_MAXDEPTH) {
+        W("bad depth %u", depth);
+        return 0;
+    }
+
+    if (!(ch = kmem_cache_alloc(msgchan_cache)))
+        return 0;
+    ch->depth = depth;      // the rest: constructed, or left empty by msgchan_free()
+    return ch;
+}
+
+/* destroy a channel. pages of undelivered msgs are freed.
+caller must ensure no task is still using the channel */
+void msgchan_free(struct msgchan *ch) {
+    acquire(&ch->lock);
+    while (ch->head != ch->tail) {
+        free_page(ch->q[ch->tail % MSGCHAN_MAXDEPTH].page);
+        ch->tail++;
+    }
+    ch->head = ch->tail = 0;
+    release(&ch->lock);
+    kmem_cache_free(msgchan_cache, ch);
+}
+
+/* cf pipe_wait() */
+static int msg_wait(struct msgchan *ch, struct condvar *cv, int timeout,
+                    unsigned long deadline) {
+    unsigned long now;
+
+    if (timeout == MSG_NONBLOCK)
+        return -1;
+    if (timeout == MSG_BLOCK) {
+        cv_wait(cv, &ch->lock);
+        return 0;
+    }
+    now = current_time_ms();
+    if (now >= deadline)
+        return -1;
+    cv_wait_timeout(cv, &ch->lock, deadline - now);
+    return 0;
+}
+
+/* queue @page (pa) with @len valid bytes. @timeout: MSG_BLOCK, MSG_NONBLOCK,
+or ms. return 0 on success (the page now belongs to the channel);
+-1 if the queue stays full (the caller still owns the page) */
+int msg_send(struct msgchan *ch, unsigned long page, unsigned len,
+             unsigned tag, int timeout) {
+    unsigned long deadline = timeout > 0 ? current_time_ms() + timeout : 0;
+    struct msg *m;
+
+    BUG_ON(!page || (page & ~PAGE_MASK) || len > PAGE_SIZE);
+
+    acquire(&ch->lock);
+    while (ch->head - ch->tail == ch->depth) {  // full
+        if (msg_wait(ch, &ch->notfull, timeout, deadline) < 0)
+            {release(&ch->lock); return -1;}
+    }
+    m = &ch->q[ch->head % MSGCHAN_MAXDEPTH];
+    m->page = page;
+    m->len = len;
+    m->tag = tag;
+    if (ch->head++ == ch->tail)     // empty -> non-empty
+        cv_signal(&ch->notempty);
+    release(&ch->lock);
+    return 0;
+}
+
+/* dequeue a msg to @m. @timeout: same as msg_send().
+return 0 on success (the caller now owns m->page); -1 if the queue stays
+empty */
+int msg_recv(struct msgchan *ch, struct msg *m, int timeout) {
+    unsigned long deadline = timeout > 0 ? current_time_ms() + timeout : 0;
+
+    acquire(&ch->lock);
+    while (ch->head == ch->tail) {  // empty
+        if (msg_wait(ch, &ch->notempty, timeout, deadline) < 0)
+            {release(&ch->lock); return -1;}
+    }
+    *m = ch->q[ch->tail % MSGCHAN_MAXDEPTH];
+    if (ch->head - ch->tail++ == ch->depth)    // full -> non-full
+        cv_signal(&ch->notfull);
+    if (ch->head != ch->tail)       // more msgs: next receiver, if any
+        cv_signal(&ch->notempty);
+    release(&ch->lock);
+    return 0;
+}
+
+/* # of msgs queued. a snapshot, for polling */
+unsigned msg_pending(struct msgchan *ch) {
+    unsigned n;
+    acquire(&ch->lock);
+    n = ch->head - ch->tail;
+    release(&ch->lock);
+    return n;
+}
@@ -0,0 +1,31 @@
+// Message channels: pass whole pages between kernel tasks. cf msgchan.c
+
+#ifndef MSGCHAN_H
+#define MSGCHAN_H
+
+#include "spinlock.h"
+#include "sync.h"
+
+#define MSGCHAN_MAXDEPTH    32  // max queue depth of a channel
+
+/* a message: one page, whose ownership moves from the sender to the receiver */
+struct msg {
+  unsigned long page;   // pa, from get_free_page()
+  unsigned len;         // # of valid bytes in the page
+  unsigned tag;         // opaque to the channel, e.g. a msg type or frame #
+};
+
+struct msgchan {
+  struct spinlock lock;   // protects everything below
+  unsigned depth;         // queue bound, <= MSGCHAN_MAXDEPTH
+  unsigned head, tail;    // free running. # of queued msgs = head - tail
+  struct msg q[MSGCHAN_MAXDEPTH];
+  struct condvar notempty;  // receivers wait here
+  struct condvar notfull;   // senders wait here
+};
+
+/* @timeout for msg_send()/msg_recv() */
+#define MSG_NONBLOCK    0
+#define MSG_BLOCK       (-1)
+
+#endif
@@ -43,8 +43,35 @@
 // the malloc()/free() region which is carved out from the paging area
 // #define MALLOC_PAGES  (16*1024*1024 / PAGE_SIZE)  
 #define MALLOC_PAGES  (8*1024*1024 / PAGE_SIZE)  
+#define SLAB_AC_LIMIT   16  // max objects in a per-cpu object cache. cf slab.c
+#define SLAB_AC_BATCH   8   // objects moved between per-cpu cache & slabs at once
 
 #define MAX_TASK_KER_PAGES      16       //max kernel pages per task. 
+#define MAX_TASK_USER_PAGES     16       //max user pages per task. 
+
+// buddy allocator: largest block is 2^(MAX_ORDER-1) pages, i.e. 4MB
+#define MAX_ORDER       11
+// per-cpu page caches: default watermarks (in pages). cf alloc.c
+#define PCP_LOW         0
+#define PCP_HIGH        64
+#define PCP_BATCH       16
+// pre-zeroed pages per cpu, refilled by the idle loop. cf alloc.c
+#define ZERO_POOL_HIGH  32
+// page colouring: shared L2 of the A53 cluster, 512KB 16-way. cf alloc.c
+#define L2_CACHE_SIZE   (512 * 1024)
+#define L2_CACHE_WAYS   16
+#define NR_PAGE_COLOURS (L2_CACHE_SIZE / L2_CACHE_WAYS / PAGE_SIZE)   // 8
+#define COLOUR_BIN_HIGH 32      // max free pages per colour bin
+
+// sched ticks: rate at boot, and bounds for set_sched_tick_hz(). cf timer.c 
+#define SCHED_TICK_HZ       100
+#define SCHED_TICK_HZ_MIN   10
+#define SCHED_TICK_HZ_MAX   1000
+// task priorities (credits) are in ticks at this rate, i.e. 10ms each. cf sched.c
+#define SCHED_BASE_HZ       100
+
+// timing wheel for coarse timeouts: granularity. cf timer.c
+#define WHEEL_TICK_MS   10
 
 #ifndef __ASSEMBLER__
 // below keeps xv6 code happy. TODO: separate them out
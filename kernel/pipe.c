@@ -0,0 +1,208 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    Kernel pipes: a byte stream between kernel tasks, derived from xv6's
+    pipe.c (and our old toy pipe in unittests.c).
+
+    Design:
+    - the buffer is a page (or a power-of-2 part of it); the free running
+      nread/nwrite counters are masked only when indexing
+    - bytes are moved in bulk: at most two memmove() per call for each
+      contiguous region, instead of one byte per loop iteration
+    - wakeup coalescing: a writer wakes up a reader only when the buffer goes
+      from empty to non-empty, and a reader wakes up a writer only when the
+      buffer goes from full to non-full. These are the only states in which
+      the peer may be sleeping. If a woken task leaves data (space) behind,
+      it passes the wakeup on to the next reader (writer), if any.
+
+    Each of read/write comes in three flavors: blocking, non-blocking, and
+    timed (in ms). cf pipe_{read|write}_timeout() for return values.
+
+    struct pipe comes from a typed slab cache. The lock and condvars are
+    initialized once by the constructor, and stay valid across free/alloc.
+*/
+
+#include "plat.h"
+#include "utils.h"
+#include "slab.h"
+#include "pipe.h"
+
+static struct kmem_cache *pipe_cache;
+
+static void pipe_ctor(void *obj) {
+    struct pipe *pi = obj;
+    initlock(&pi->lock, "pipe");
+    cv_init(&pi->notempty, "pipe-notempty");
+    cv_init(&pi->notfull, "pipe-notfull");
+    pi->data = 0;
+}
+
+void pipe_init(void) {
+    pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), 0,
+        pipe_ctor, SLAB_COLOUR);
+    BUG_ON(!pipe_cache);
+}
+
+/* create a pipe, whose buffer has @size bytes (0: a whole page).
+return 0 on failure */
+struct pipe *pipe_alloc(unsigned size) {
+    struct pipe *pi;
+    unsigned long page;
+
+    if (!size)
+        size = PAGE_SIZE;
+    if ((size & (size - 1)) || size > PAGE_SIZE) {
+        W("bad pipe size %u", size);
+        return 0;
+    }
+
+    if (!(pi = kmem_cache_alloc(pipe_cache)))
+        return 0;
+    if (!(page = get_free_page_nozero())) {    // never read before written
+        kmem_cache_free(pipe_cache, pi);
+        return 0;
+    }
+
+    // lock & condvars: already constructed
+    pi->data = (char *)page;
+    pi->size = size;
+    pi->nread = pi->nwrite = 0;
+    pi->readopen = pi->writeopen = 1;
+    return pi;
+}
+
+/* close one end of the pipe (@writable: the write end).
+the pipe is freed once both ends are closed */
+void pipe_close(struct pipe *pi, int writable) {
+    int dofree;
+
+    acquire(&pi->lock);
+    if (writable)
+        pi->writeopen = 0;
+    else
+        pi->readopen = 0;
+    // the peer may be waiting for data/space that will never come
+    cv_broadcast(&pi->notempty);
+    cv_broadcast(&pi->notfull);
+    dofree = !pi->readopen && !pi->writeopen;
+    release(&pi->lock);
+
+    if (dofree) {
+        free_page((unsigned long)pi->data);
+        pi->data = 0;
+        kmem_cache_free(pipe_cache, pi);    // still constructed
+    }
+}
+
+/* wait on @cv per @timeout (PIPE_BLOCK, PIPE_NONBLOCK, or ms w/ @deadline).
+caller holds pi->lock and must recheck its condition afterwards.
+return 0 if it may retry, -1 if it must give up */
+static int pipe_wait(struct pipe *pi, struct condvar *cv, int timeout,
+                     unsigned long deadline) {
+    unsigned long now;
+
+    if (timeout == PIPE_NONBLOCK)
+        return -1;
+    if (timeout == PIPE_BLOCK) {
+        cv_wait(cv, &pi->lock);
+        return 0;
+    }
+    now = current_time_ms();
+    if (now >= deadline)
+        return -1;
+    cv_wait_timeout(cv, &pi->lock, deadline - now);
+    return 0;
+}
+
+/* write @n bytes from @buf. return # of bytes written, which is less than
+@n if the call times out (or would block), or -1 if the read end is closed
+before anything is written */
+int pipe_write_timeout(struct pipe *pi, const char *buf, int n, int timeout) {
+    unsigned long deadline = timeout > 0 ? current_time_ms() + timeout : 0;
+    unsigned used, off, k;
+    int i = 0;
+
+    BUG_ON(timeout < PIPE_BLOCK);   // would act as PIPE_NONBLOCK
+
+    acquire(&pi->lock);
+    while (i < n) {
+        if (!pi->readopen) {
+            if (!i) i = -1;     // broken pipe
+            break;
+        }
+        used = pi->nwrite - pi->nread;
+        if (used == pi->size) {     // full
+            if (pipe_wait(pi, &pi->notfull, timeout, deadline) < 0)
+                break;
+            continue;
+        }
+        // as much as fits before wrapping around
+        off = pi->nwrite & (pi->size - 1);
+        k = MIN((unsigned)(n - i), pi->size - used);
+        k = MIN(k, pi->size - off);
+        memmove(pi->data + off, buf + i, k);
+        pi->nwrite += k;
+        i += k;
+        if (used == 0)              // empty -> non-empty
+            cv_signal(&pi->notempty);
+    }
+    // space left: pass it on to the next writer, if any
+    if (pi->nwrite - pi->nread < pi->size)
+        cv_signal(&pi->notfull);
+    release(&pi->lock);
+    return i;
+}
+
+/* read up to @n bytes to @buf. block (per @timeout) only if the pipe is
+empty. return # of bytes read; 0 on EOF (write end closed and pipe empty);
+-1 if the call times out (or would block) */
+int pipe_read_timeout(struct pipe *pi, char *buf, int n, int timeout) {
+    unsigned long deadline = timeout > 0 ? current_time_ms() + timeout : 0;
+    unsigned off, k;
+    int i = 0, wasfull;
+
+    BUG_ON(timeout < PIPE_BLOCK);
+
+    acquire(&pi->lock);
+    while (pi->nread == pi->nwrite) {   // empty
+        if (!pi->writeopen)
+            {release(&pi->lock); return 0;}
+        if (pipe_wait(pi, &pi->notempty, timeout, deadline) < 0)
+            {release(&pi->lock); return -1;}
+    }
+
+    wasfull = (pi->nwrite - pi->nread == pi->size);
+    while (i < n && pi->nread != pi->nwrite) {
+        off = pi->nread & (pi->size - 1);
+        k = MIN((unsigned)(n - i), pi->nwrite - pi->nread);
+        k = MIN(k, pi->size - off);
+        memmove(buf + i, pi->data + off, k);
+        pi->nread += k;
+        i += k;
+    }
+
+    if (wasfull)                        // full -> non-full
+        cv_signal(&pi->notfull);
+    if (pi->nread != pi->nwrite)        // data left: next reader, if any
+        cv_signal(&pi->notempty);
+    release(&pi->lock);
+    return i;
+}
+
+int pipe_write(struct pipe *pi, const char *buf, int n) {
+    return pipe_write_timeout(pi, buf, n, PIPE_BLOCK);
+}
+
+int pipe_write_nb(struct pipe *pi, const char *buf, int n) {
+    return pipe_write_timeout(pi, buf, n, PIPE_NONBLOCK);
+}
+
+int pipe_read(struct pipe *pi, char *buf, int n) {
+    return pipe_read_timeout(pi, buf, n, PIPE_BLOCK);
+}
+
+int pipe_read_nb(struct pipe *pi, char *buf, int n) {
+    return pipe_read_timeout(pi, buf, n, PIPE_NONBLOCK);
+}
@@ -0,0 +1,25 @@
+// Kernel pipes: byte streams between kernel tasks. cf pipe.c
+
+#ifndef PIPE_H
+#define PIPE_H
+
+#include "spinlock.h"
+#include "sync.h"
+
+struct pipe {
+  struct spinlock lock;   // protects everything below
+  char *data;             // buffer: one page from get_free_page() (pa)
+  unsigned size;          // buffer size, power of 2, <= PAGE_SIZE
+  unsigned nread;         // # of bytes read, free running
+  unsigned nwrite;        // # of bytes written, free running
+  int readopen;           // read end is still open
+  int writeopen;          // write end is still open
+  struct condvar notempty;  // readers wait here
+  struct condvar notfull;   // writers wait here
+};
+
+/* @timeout for pipe_{read|write}_timeout(), or > 0 in ms. others: a bug */
+#define PIPE_NONBLOCK   0
+#define PIPE_BLOCK      (-1)
+
+#endif
@@ -111,8 +111,9 @@
 #define TIMER_INT_CTRL_0    0x40000040UL    // per core irq control 
 #define INT_SOURCE_0        (LPBASE+0x60)   // "CORE0_IRQ_SOURCE" in the manual above
 
-#define TIMER_INT_CTRL_0_VALUE  (1 << 1) 
-#define GENERIC_TIMER_INTERRUPT (1U<<1) // CNTPNSIRQ
+#define TIMER_INT_CTRL_0_VALUE  ((1 << 1) | (1 << 3))     // CNTP & CNTV irqs
+#define GENERIC_TIMER_INTERRUPT (1U<<1) // CNTPNSIRQ. sched ticks
+#define GENERIC_VTIMER_INTERRUPT (1U<<3) // CNTVIRQ. vtimers, cf timer.c
 #define GPU_SIDE_INTERRUPT      (1U<<8)        // GPU side interrupt, "Interrupt source bits" in manual above
 
 // ---------------- mbox  ------------------------------------ //
@@ -19,6 +19,10 @@
 #define PGROUNDUP(sz)  (((sz)+PAGE_SIZE-1) & ~(PAGE_SIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PAGE_SIZE-1))
 
+// cortex-a53: 64-byte lines in both L1D and L2
+#define CACHE_LINE_SHIFT    6
+#define CACHE_LINE_SIZE     (1 << CACHE_LINE_SHIFT)
+
 // ------------------ phys mem layout ----------------------------------------//
 // region reserved for ramdisk. the actual ramdisk can be smaller.
 // at this time, uncompressed ramdisk is linked into kernel image and used in place. 
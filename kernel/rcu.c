@@ -0,0 +1,111 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    A tiny, classic (non-preemptible) RCU.
+
+    Readers, e.g. procdump() walking task[], run w/o locks inside
+    rcu_read_lock()/rcu_read_unlock(). An updater unlinks/retires an object
+    and calls call_rcu(); the object is reclaimed (the callback runs) only
+    after every cpu has passed a quiescent state (QS), i.e. a point where it
+    cannot be inside a read-side critical section. By then no reader can
+    still hold a reference to the object.
+
+    QS: a context switch (switch_to()), or a timer tick, which can only be
+    taken w/ irq on -- never inside a reader, which runs w/ irq off.
+
+    Grace period (GP) detection: each cpu counts its QSs (cpu::rcu_qs). When
+    a GP starts, we snapshot all counters; the GP ends once every counter has
+    moved. Callbacks are batched: those queued while a GP is in progress wait
+    for the next GP. All bookkeeping is driven by the timer tick
+    (rcu_check_callbacks()), which also runs the callbacks, in irq context.
+*/
+
+#include "plat.h"
+#include "utils.h"
+#include "sched.h"
+#include "sync.h"
+#include "rcu.h"
+
+static struct spinlock rcu_lock = {.locked=0, .cpu=0, .name="rcu"};
+// protected by rcu_lock
+static struct rcu_head *nextlist = 0;          // waiting for a GP to start
+static struct rcu_head **nexttail = &nextlist;
+static struct rcu_head *waitlist = 0;          // waiting for the current GP
+static int gp_active = 0;
+static unsigned long gp_snap[NCPU];            // cpu::rcu_qs at GP start
+unsigned long rcu_gp_completed = 0;            // stats
+
+/* report a quiescent state for this cpu. called w/ irq off */
+void rcu_qs(void) {
+    mycpu()->rcu_qs++;
+}
+
+/* queue @func(@head) to be called after a grace period.
+can be called from any context, including with sched_lock held */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *)) {
+    head->func = func;
+    head->next = 0;
+    acquire(&rcu_lock);
+    *nexttail = head;
+    nexttail = &head->next;
+    release(&rcu_lock);
+}
+
+/* caller must hold rcu_lock */
+static int gp_done(void) {
+    for (int i = 0; i < NCPU; i++)
+        if (cpus[i].rcu_qs == gp_snap[i])
+            return 0;
+    return 1;
+}
+
+/* called on each timer tick, w/ irq off and no locks held. advance the GP
+state machine and invoke the callbacks whose GP has ended */
+void rcu_check_callbacks(void) {
+    struct rcu_head *done = 0, *next;
+
+    rcu_qs();   // being in the tick, this cpu is not in a reader
+
+    acquire(&rcu_lock);
+    if (gp_active && gp_done()) {
+        done = waitlist;
+        waitlist = 0;
+        gp_active = 0;
+        rcu_gp_completed++;
+    }
+    if (!gp_active && nextlist) {   // start a new GP for the pending batch
+        waitlist = nextlist;
+        nextlist = 0;
+        nexttail = &nextlist;
+        for (int i = 0; i < NCPU; i++)
+            gp_snap[i] = cpus[i].rcu_qs;
+        gp_active = 1;
+    }
+    release(&rcu_lock);
+
+    // w/o rcu_lock, so callbacks may take other locks, or call_rcu()
+    for (; done; done = next) {
+        next = done->next;
+        done->func(done);
+    }
+}
+
+struct rcu_synchronize {
+    struct rcu_head head;
+    struct completion done;
+};
+
+static void wakeme_after_rcu(struct rcu_head *head) {
+    complete(&container_of(head, struct rcu_synchronize, head)->done);
+}
+
+/* wait (sleep) until a full grace period has elapsed. task context only */
+void synchronize_rcu(void) {
+    struct rcu_synchronize rs;
+
+    init_completion(&rs.done, "rcu_sync");
+    call_rcu(&rs.head, wakeme_after_rcu);
+    wait_for_completion(&rs.done);
+}
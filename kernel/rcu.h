@@ -0,0 +1,24 @@
+// Minimal RCU (read-copy-update) for lockless readers. cf rcu.c
+
+#ifndef RCU_H
+#define RCU_H
+
+#include "utils.h"
+
+/* embedded in an object whose reclamation is deferred by call_rcu() */
+struct rcu_head {
+  struct rcu_head *next;
+  void (*func)(struct rcu_head *head);
+};
+
+/* read-side critical section. readers must not sleep/yield inside.
+Since a context switch (or timer tick) marks a quiescent state, a reader
+only has to keep the cpu to itself, i.e. irq off */
+static inline void rcu_read_lock(void) {push_off();}
+static inline void rcu_read_unlock(void) {pop_off();}
+
+/* publish a pointer to an initialized object / read it in a reader */
+#define rcu_assign_pointer(p, v)  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define rcu_dereference(p)        __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+#endif
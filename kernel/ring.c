@@ -0,0 +1,151 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    Lock-free ring buffers, modeled after DPDK's rte_ring.
+
+    SPSC: exactly one producer and one consumer (e.g. irq handler -> task).
+    No lock, no atomic read-modify-write: each side only writes its own
+    index, and publishes it with a store-release after copying the elements
+    (load-acquire on the other side).
+
+    MPSC: many producers, one consumer. A producer first reserves slots by
+    CAS on prod_head, copies its elements, then waits for earlier producers
+    to publish before advancing prod_tail. The consumer side is the same as
+    SPSC.
+
+    All enqueue/dequeue funcs are "burst": they move as many of the @n
+    elements as possible and return that number (0 if full/empty). Bulk
+    copies are done with at most two memcpy()s (before/after wrapping).
+
+    NB: CAS compiles to exclusive load/store (ldaxr/stlxr), which requires
+    cacheable memory on real hw (cf spinlock.c). SPSC does not have this
+    limitation.
+*/
+
+#include "plat.h"
+#include "utils.h"
+#include "ring.h"
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define load_relaxed(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* @data: buffer of nelems*esize bytes. @nelems: must be power of 2
+return 0 on success */
+int ring_init(struct ring *r, void *data, unsigned nelems, unsigned esize) {
+    if (!r || !data || !esize || !nelems || (nelems & (nelems - 1))
+        || nelems > (1U << 31)) {
+        W("bad para: nelems %u esize %u", nelems, esize);
+        return -1;
+    }
+    r->prod_head = r->prod_tail = r->cons_tail = 0;
+    r->size = nelems;
+    r->mask = nelems - 1;
+    r->esize = esize;
+    r->data = data;
+    return 0;
+}
+
+/* # of elements in the ring. a snapshot, may be stale upon return */
+unsigned ring_count(struct ring *r) {
+    return load_acquire(&r->prod_tail) - load_acquire(&r->cons_tail);
+}
+
+unsigned ring_free_count(struct ring *r) {
+    return r->size - ring_count(r);
+}
+
+static inline void copy_bytes(void *dst, const void *src, unsigned n) {
+    if (!n)
+        return;
+    if ((((unsigned long)dst | (unsigned long)src | n) & 7) == 0)
+        memcpy_aligned(dst, src, n);
+    else
+        memcpy(dst, src, n);
+}
+
+/* copy @n elements from @src into slots starting at index @idx */
+static inline void ring_copy_in(struct ring *r, unsigned idx,
+                                const void *src, unsigned n) {
+    unsigned off = idx & r->mask;
+    unsigned n1 = MIN(n, r->size - off);    // before wrap around
+    copy_bytes(r->data + off * r->esize, src, n1 * r->esize);
+    copy_bytes(r->data, (const char *)src + n1 * r->esize, (n - n1) * r->esize);
+}
+
+static inline void ring_copy_out(struct ring *r, unsigned idx,
+                                 void *dst, unsigned n) {
+    unsigned off = idx & r->mask;
+    unsigned n1 = MIN(n, r->size - off);
+    copy_bytes(dst, r->data + off * r->esize, n1 * r->esize);
+    copy_bytes((char *)dst + n1 * r->esize, r->data, (n - n1) * r->esize);
+}
+
+/* -------------  SPSC  -------------------- */
+
+/* enqueue up to @n elements from @src. return # of elements enqueued.
+only one producer may call this at a time */
+unsigned spsc_enqueue(struct ring *r, const void *src, unsigned n) {
+    unsigned head = r->prod_tail;   // only we write it
+    unsigned nfree = r->size - (head - load_acquire(&r->cons_tail));
+
+    n = MIN(n, nfree);
+    if (!n)
+        return 0;
+    ring_copy_in(r, head, src, n);
+    store_release(&r->prod_tail, head + n); // publish
+    return n;
+}
+
+/* dequeue up to @n elements to @dst. return # of elements dequeued.
+only one consumer may call this at a time. also the consumer for MPSC */
+unsigned spsc_dequeue(struct ring *r, void *dst, unsigned n) {
+    unsigned tail = r->cons_tail;   // only we write it
+    unsigned avail = load_acquire(&r->prod_tail) - tail;
+
+    n = MIN(n, avail);
+    if (!n)
+        return 0;
+    ring_copy_out(r, tail, dst, n);
+    store_release(&r->cons_tail, tail + n); // give slots back
+    return n;
+}
+
+/* -------------  MPSC  -------------------- */
+
+/* enqueue up to @n elements from @src. return # of elements enqueued.
+safe for concurrent producers, including irq handlers */
+unsigned mpsc_enqueue(struct ring *r, const void *src, unsigned n) {
+    unsigned head, nfree, k;
+
+    /* a producer must not be preempted (or interrupted by another producer
+    on the same cpu) between reserving and publishing: the later producers
+    would spin on it forever */
+    push_off();
+
+    head = load_relaxed(&r->prod_head);
+    do {
+        nfree = r->size - (head - load_acquire(&r->cons_tail));
+        k = MIN(n, nfree);
+        if (!k)
+            {pop_off(); return 0;}
+        /* on failure, @head is refreshed with the current prod_head */
+    } while (!__atomic_compare_exchange_n(&r->prod_head, &head, head + k,
+                1 /*weak*/, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    ring_copy_in(r, head, src, k);
+
+    /* publish in reservation order: wait for producers ahead of us */
+    while (load_relaxed(&r->prod_tail) != head)
+        ;
+    store_release(&r->prod_tail, head + k);
+
+    pop_off();
+    return k;
+}
+
+unsigned mpsc_dequeue(struct ring *r, void *dst, unsigned n) {
+    return spsc_dequeue(r, dst, n);
+}
@@ -0,0 +1,27 @@
+// Lock-free ring buffers: single-producer/single-consumer (SPSC) and
+// multi-producer/single-consumer (MPSC). cf ring.c
+
+#ifndef RING_H
+#define RING_H
+
+#include "plat.h"
+#include "utils.h"
+
+/* Indices are free running (they wrap around at 2^32, never masked until
+  used), so "head - tail" is always the # of used slots.
+  Producer and consumer indices live on separate cache lines, so that the
+  two sides won't bounce one line back and forth. */
+struct ring {
+  /* producer side */
+  unsigned prod_head __cacheline_aligned; // next slot to reserve. MPSC only
+  unsigned prod_tail;     // slots before this are visible to the consumer
+  /* consumer side */
+  unsigned cons_tail __cacheline_aligned; // slots before this are free
+  /* read only after ring_init() */
+  unsigned size __cacheline_aligned;  // # of slots, power of 2
+  unsigned mask;          // size-1
+  unsigned esize;         // element size in bytes
+  char *data;             // size*esize bytes, provided by the caller
+};
+
+#endif
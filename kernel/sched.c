@@ -8,6 +8,7 @@
 #include "printf.h"
 #include "spinlock.h"
 #include "entry.h"
+#include "timer.h"
 
 /* kernel_stacks[i]: kernel stack for task with pid=i.
 WARNING: various kernel code assumes each kernel stack is page-aligned.
@@ -32,7 +33,8 @@ static char *states[] = {
     [TASK_RUNNING]  "RUNNING ",
     [TASK_SLEEPING] "SLEEP   ",
     [TASK_RUNNABLE] "RUNNABLE",
-    [TASK_ZOMBIE]   "ZOMBIE  "};
+    [TASK_ZOMBIE]   "ZOMBIE  ",
+    [TASK_DEAD]     "DEAD    "};
     
 struct task_struct *myproc(void) {      
     struct task_struct *p;
@@ -84,6 +86,13 @@ void sched_init(void) {
     safestrcpy(init_task->name, "init", 5);
 }
 
+/* task::priority is in ticks at SCHED_BASE_HZ; credits are in ticks at the 
+current rate, so that a timeslice lasts as long whatever the rate. cf timer.c */
+static inline long prio_to_credits(long prio) {
+    long c = prio * sched_tick_hz / SCHED_BASE_HZ; 
+    return c > 0 ? c : 1; 
+}
+
 /* return cpuid for the task currently on; 
 -1 on no found or error
 caller must hold sched_lock */
@@ -147,7 +156,7 @@ void schedule() {
                 p = task[i]; BUG_ON(!p);
                 if (p->state != TASK_UNUSED) {
                     /* NB: p->credits/priority protected by sched_lock */
-                    p->credits = (p->credits >> 1) + p->priority;  // per priority
+                    p->credits = (p->credits >> 1) + prio_to_credits(p->priority);  // per priority
                 }                
             }
         } else { /* reason2: no normal tasks RUNNABLE (inc. cur task) */
@@ -199,6 +208,11 @@ void switch_to(struct task_struct * next) {
 
 	prev = cur;
 	mycpu()->proc = next;
+    rcu_qs();   // cpu leaves prev: no rcu reader can be active here
+    /* a kernel task (mm=0) runs in whatever is in ttbr0 (lazy): no need to
+    switch, its va are all global */
+	if (next->mm && next->mm != mycpu()->active_mm)
+		switch_mm(next->mm); 	// mm.c. no TLB flush
 
 	if (prev->state == TASK_RUNNING) // preempted 
 		prev->state = TASK_RUNNABLE; 
@@ -225,7 +239,7 @@ void switch_to(struct task_struct * next) {
     cpu_switch_to(prev, next); /* STUDENT: TODO: replace this */
 }
 
-#define CPU_UTIL_INTERVAL 10  // cal cpu measurement every X ticks
+#define CPU_UTIL_INTERVAL 10  // cal cpu measurement every X ticks, at SCHED_BASE_HZ
 
 /* Called by handle_generic_timer_irq(), i.e. timer irq handler, with irq 
     automatically turned off by hardware. irq status can be checked by 
@@ -233,14 +247,18 @@ void switch_to(struct task_struct * next) {
 void timer_tick() {
     struct task_struct *cur = myproc();
     struct cpu* cp = mycpu(); 
+
+    rcu_check_callbacks(); 
+
     if (cur) { // update task::credits, decide if schedule() is needed
         V("enter timer_tick cpu%d task %s pid %d", cpuid(), cur->name, cur->pid);
         if (cur->pid>=0 && cur->state == TASK_RUNNING) // not "idle" (pid -1), and running
             cp->busy++; 
 
         // calculate cpu util %     Qx: quest: hide this until later lab
-        if ((cp->total++ % CPU_UTIL_INTERVAL) == CPU_UTIL_INTERVAL - 1) {
-            cp->last_util = cp->busy * 100 / CPU_UTIL_INTERVAL; 
+        unsigned util_ticks = CPU_UTIL_INTERVAL * sched_tick_hz / SCHED_BASE_HZ; 
+        if ((cp->total++ % util_ticks) == util_ticks - 1) {
+            cp->last_util = cp->busy * 100 / util_ticks; 
             cp->busy = 0; 
             V("cpu%d util %d/100, cur %s", cpuid(), cp->last_util, cur->name); 
             #if K2_ACTUAL_DEBUG_LEVEL <= 20     // "V"
@@ -268,8 +286,13 @@ void timer_tick() {
        
        That is why a new task starts from ret_from_fork() which calls 
        leave_scheduler() to enable irq. */
+
+    /* the tick interrupted timer callbacks (cf timer.c): don't switch away
+    from under them. credits are 0: retry at the next tick */
+    if (cp->in_softirq)
+        return; 
     
-	schedule();
+    schedule();
 
     V("leave timer_tick cpu%d task %s pid %d", cpuid(), cur->name, cur->pid);
 	
@@ -297,15 +320,14 @@ wakeup(). inside wakeup(), task A is further serialized on schedlock, which
 must wait until that task B has completely changed its p->state and is moved
 off the cpu */
 
-/* Wake up all processes sleeping on chan. Only change p->state; wont call
-schedule() return # of tasks woken up.
+/* Wake up at most @n processes sleeping on chan (n<0: all). Only change
+p->state; wont call schedule() return # of tasks woken up.
 Caller must hold sched_lock  */
-// Q9: quest: "wordsmith"
-static int wakeup_nolock(void *chan) {
+static int wakeup_n_nolock(void *chan, int n) {
     struct task_struct *p;
     int cnt = 0; 
 
-    for (int i = 0; i < NR_TASKS; i++) {
+    for (int i = 0; i < NR_TASKS && cnt != n; i++) {
         p = task[i];
         if (p->state == TASK_UNUSED)
             continue;
@@ -319,6 +341,12 @@ static int wakeup_nolock(void *chan) {
     return cnt; 
 }
 
+/* Wake up all processes sleeping on chan. Caller must hold sched_lock */
+// Q9: quest: "wordsmith"
+static int wakeup_nolock(void *chan) {
+    return wakeup_n_nolock(chan, -1); 
+}
+
 /* Must be called WITHOUT sched_lock 
 Called from irq (many drivers) or task
 return # of tasks woken up */
@@ -331,6 +359,19 @@ int wakeup(void *chan) {
     return cnt; 
 }
 
+/* Same as wakeup(), but wake up at most @n tasks (n<0: all). 
+A producer can thus signal once per batch, waking only as many consumers as
+there are items. Must be called WITHOUT sched_lock */
+int wakeup_n(void *chan, int n) {
+    int cnt; 
+    if (n == 0)
+        return 0; 
+    acquire(&sched_lock);     
+    cnt = wakeup_n_nolock(chan, n); 
+    release(&sched_lock);
+    return cnt; 
+}
+
 /* Atomically release "lk" and sleep on chan.
 Reacquires lk when awakened.
 Called by tasks with @lk held */
@@ -403,6 +444,63 @@ struct task_struct *idle = idle_tasks[cpuid()]; /* STUDENT: TODO: replace this *
     } /* else keep holding sched_lock */
 }
 
+/* the wtimer of a sleep_timeout(), on the sleeper's stack */
+struct sleep_timer {
+    struct wtimer wt; 
+    void *chan;     // the chan it sleeps on 
+}; 
+
+/* wtimer callback for sleep_timeout(). Runs in the timer softirq */
+static void sleep_timeout_handler(struct wtimer *wt) {
+    struct task_struct *p = wt->data; 
+    void *context = container_of(wt, struct sleep_timer, wt)->chan; 
+
+    acquire(&sched_lock); 
+    /* set the flag even if @p has not gone to sleep yet; sleep_timeout() 
+    checks it under sched_lock, so the timeout cannot be lost */
+    p->timedout = 1; 
+    if (p->state == TASK_SLEEPING && p->chan == context) {
+        p->state = TASK_RUNNABLE;
+        p->chan = 0;
+    }
+    release(&sched_lock); 
+}
+
+/* Like sleep(), but also wake up after @ms milliseconds. 
+Called by tasks with @lk held; @lk must not be sched_lock (the timer callback
+grabs sched_lock). Reacquires lk before return. 
+return 0 if woken up by wakeup(), -1 if timed out */
+int sleep_timeout(void *chan, struct spinlock *lk, unsigned ms) {
+    struct task_struct *p = myproc();
+    struct sleep_timer st; 
+    int timedout; 
+
+    BUG_ON(lk == &sched_lock); 
+
+    /* timeouts are coarse and mostly cancelled: the timing wheel, O(1)
+    start & cancel and no allocation */
+    p->timedout = 0;     
+    wtimer_init(&st.wt, sleep_timeout_handler, p); 
+    st.chan = chan; 
+    wtimer_start(&st.wt, ms); 
+
+    /* same lock handoff as sleep(): once we hold sched_lock, neither 
+    wakeup() nor the timer callback can slip in between */
+    acquire(&sched_lock);
+    release(lk); 
+    if (!p->timedout)
+        sleep(chan, &sched_lock);   // returns w/ sched_lock held
+    release(&sched_lock);
+    acquire(lk); 
+
+    /* we hold lk with irq off, so on UP the timer callback either has run 
+    (p->timedout set) or cannot run until we cancel it below */
+    timedout = p->timedout; 
+    if (!timedout)
+        wtimer_cancel(&st.wt); 
+    return timedout ? -1 : 0; 
+}
+
 /* Pass p's abandoned children to init. (ie direct reparent to initprocess)
 return # of children reparanted
 Caller must hold sched_lock. */
@@ -483,6 +581,14 @@ void exit_process(int status) {
     if (p == init_task)
         panic("init exiting");
 
+    /* drop the address space, if any. the cpu may keep it in ttbr0 till
+    the last ref is gone, cf mm_release() */
+    if (p->mm) {
+        struct mm_struct *mm = p->mm;
+        p->mm = 0; 
+        mm_release(mm); 
+    }
+
     /* This prevents the parent from checking & recycling this zombie until 
     the cpu moves away from the zombie's stack (see below) */
     acquire(&sched_lock); 
@@ -517,14 +623,30 @@ void exit_process(int status) {
     panic("zombie exit");
 }
 
+/* rcu callback: now no lockless reader (e.g. procdump()) can still be 
+    looking at the dead task, its slot can be reused by copy_process() */
+static void task_reclaim(struct rcu_head *head) {
+    struct task_struct *p = container_of(head, struct task_struct, rcu); 
+    acquire(&sched_lock); 
+    BUG_ON(p->state != TASK_DEAD); 
+    p->state = TASK_UNUSED; 
+    release(&sched_lock); 
+}
+
 /* Destroys a task: task_struct, kernel stack, etc. free a proc structure and
     the data hanging from it, including user & kernel pages. 
 
+    The slot is not reused right away: lockless readers of task[] may be
+    still looking at it. So mark it dead, and reclaim it after an rcu 
+    grace period. 
+
     sched_lock must be held.  p->lock must be held */
 static void freeproc(struct task_struct *p) {
     BUG_ON(!p); V("%s entered. pid %d", __func__, p->pid);
 
-    p->state = TASK_UNUSED; // mark the slot as unused
+    p->state = TASK_DEAD;   // not reusable until task_reclaim() 
+    p->parent = 0;          // no longer a child of anyone, cf wait()
+    call_rcu(&p->rcu, task_reclaim); 
     // o need to zero task_struct, which is among the task's kernel page
     // FIX: since we cannot recycle task slot now, so we dont dec nr_tasks ...
     p->flags = 0; 
@@ -537,11 +659,13 @@ static void freeproc(struct task_struct *p) {
 
 /* Print a process listing to console.  For debugging.
 Runs when user types ^P on console.
-No lock to avoid wedging a stuck machine further. */
+No lock to avoid wedging a stuck machine further. As an rcu reader, it won't
+see a task slot recycled under its feet */
 void procdump(void) {
     struct task_struct *p;
     char *state;
 
+    rcu_read_lock(); 
     printf("\t %5s %10s %10s %20s\n", "pid", "state", "name", "sleep-on");
 
     for (int i = 0; i < NR_TASKS; i++) {
@@ -555,11 +679,13 @@ void procdump(void) {
         printf("\t %5d %10s %10s %20lx\n", p->pid, state, p->name, 
                (unsigned long)p->chan);
     }
+    rcu_read_unlock(); 
     
-    extern unsigned paging_pages_used, paging_pages_total; // alloc.c
-	printf("paging mem: used %u total %u (%u/100)\n", 
-		paging_pages_used, paging_pages_total, 
-        paging_pages_used*100/(paging_pages_total));
+    extern unsigned paging_pages_total; // alloc.c
+    unsigned long used = nr_pages_used(); 
+	printf("paging mem: used %lu total %u (%lu/100)\n", 
+		used, paging_pages_total, 
+        used*100/(paging_pages_total));
 }
 
 /* -------------  fork related  -------------------- */
@@ -592,8 +718,14 @@ int copy_process(unsigned long clone_flags, unsigned long fn, unsigned long arg,
 	if (i == NR_TASKS) 
 		{release(&sched_lock); return -1;}
 
-	memset(p, 0, sizeof(struct task_struct));
-	initlock(&p->lock, "proc");
+	/* task slots are type-stable, like objects of a slab cache with a ctor:
+	sched_init() zeroed them and initialized p->lock once; freeproc() reset
+	most fields. so only clear what is left, instead of memset() & initlock()
+	over the whole struct */
+	memset(&p->cpu_context, 0, sizeof(p->cpu_context));
+	p->mm = 0; 
+	p->preempt_count = 0; 
+	p->timedout = 0; 
 
 	acquire(&p->lock);	
     acquire(&cur->lock);	
@@ -610,10 +742,13 @@ int copy_process(unsigned long clone_flags, unsigned long fn, unsigned long arg,
 	    safestrcpy(p->name, cur->name, sizeof(cur->name));
 
 	p->flags = clone_flags;
-	p->credits = p->priority = cur->priority;
+	p->priority = cur->priority;
+	p->credits = prio_to_credits(p->priority);
+	p->colours = cur->colours; 	// same cache partition as the parent
+	p->colour_next = 0; 
 	p->pid = pid; 
 
-	// @page is 0-filled, many fields (e.g. mm.pgd) are implicitly init'd
+	// other fields (e.g. ofile, cwd) are never set for kernel tasks and stay 0
 
     // prep new task's scheduler context: assign values to the pc/sp of new
     // task's cpu_context
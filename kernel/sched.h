@@ -13,6 +13,7 @@
 #define TASK_SLEEPING 2
 #define TASK_ZOMBIE 3
 #define TASK_RUNNABLE 4 // can run but not on any cpu
+#define TASK_DEAD 5     // reaped by wait(). slot reusable after an rcu grace period
 /* STUDENT: TODO: define more task states (as constants) below, e.g. TASK_WAIT */
 
 #define PF_KTHREAD		 0x2	// kern thread
@@ -53,12 +54,13 @@ struct trapframe {
 };
 
 #include "spinlock.h"
+#include "rcu.h"
 
 /* A user task's VM. 
   A VM can be shared by multi user tasks kernel thread has no such a thing,
-  task_struct::mm=0 will be allocated in a static table, cf mm_table STUDENT: TODO: the
-  size grows with MAX_TASK_XXX_PAGES, could be problem for larger user programs
-  in the future...
+  task_struct::mm=0. allocated from a slab cache, cf mm_alloc() in mm.c.
+  STUDENT: TODO: the size grows with MAX_TASK_XXX_PAGES, could be problem for 
+  larger user programs in the future...
  */
 struct mm_struct {
   /* # of task_structs refers to this mm_struct. 0 means invalid. 
@@ -69,13 +71,15 @@ struct mm_struct {
   
   struct spinlock lock; // to protect everything below 
 
-	unsigned long pgd;	// pa. this is loaded to ttbr0 (user va)
+	unsigned long pgd;	// pa. this is loaded to ttbr0 (user va), w/ the asid below
+	unsigned long context; 	// asid (low ASID_BITS) | generation. cf mm.c
 	
 	unsigned long sz, codesz; 	// for a user task, VA [0, sz) covers its code,data,&heap. [0,codesz) covers code &data. not page aligned
 	int user_pages_count;
 	int kernel_pages_count;
 	/* which kernel pages are used by this task, e.g. those for pgtables.  PA */
 	unsigned long kernel_pages[MAX_TASK_KER_PAGES]; 	
+	struct user_page user_pages[MAX_TASK_USER_PAGES]; 	// pages mapped to user va
 };
 
 /* the metadata describing a task */
@@ -89,6 +93,8 @@ struct task_struct {
     struct mm_struct *mm;           // =0 for kernel thread. for user threads, multi task_structs may share a mm_struct
     unsigned long flags;
     long preempt_count; // cf: preempt_enable()  TO DELETE
+    unsigned colours;   // bitmask of L2 page colours to allocate from. 0: any. cf alloc.c
+    unsigned colour_next;   // round robin among @colours
 
     struct spinlock lock;
     // the lock above protects members below
@@ -104,7 +110,10 @@ struct task_struct {
     long priority;              // when kernel schedules a new task, the kernel copies the task's  `priority` value to `credits`. Regulate CPU time the task gets relative to other tasks
     int xstate;                 // Exit status to be returned to parent's wait
     void *chan;                 // If non-zero, sleeping on chan
+    int timedout;               // set by the timer of sleep_timeout()
     struct task_struct *parent; // Parent process
+
+    struct rcu_head rcu;        // deferred slot reclamation, cf freeproc()
 };
 
 /* use the code below to check struct size at compile time
@@ -123,6 +132,9 @@ struct cpu {
     int busy;            // # of busy ticks in current measurement interval
     int last_util;       // out of 100, cpu util in the past interval
     unsigned long total; // since cpu boot
+    unsigned long rcu_qs; // # of rcu quiescent states passed. cf rcu.c
+    int in_softirq;       // running timer callbacks, irq on. no preemption. cf timer.c
+    struct mm_struct *active_mm; // whose pgd is in ttbr0. kernel tasks borrow it
 };
 extern struct cpu cpus[NCPU];		// sched.c
 
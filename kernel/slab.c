@@ -0,0 +1,405 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    Slab allocator, a simplified version of Bonwick's design (and of linux's
+    mm/slab.c). Serves kmalloc()/kfree() out of the MALLOC_PAGES region that
+    paging_init() reserves.
+
+    - a cache holds objects of one size. Its memory comes in slabs, one page
+    each: a struct slab at the start of the page (with a stack of free
+    object indices), then as many objects as fit.
+    - objects are aligned to (at least) a cache line, so no two objects
+    share a line (no false sharing between cpus).
+    - typed caches (kmem_cache_create()) may have a constructor, run once
+    per object when its slab is created, not on every alloc. Objects must be
+    freed back in their constructed state (locks released, lists empty...),
+    and the allocator never writes into a free object, so that state
+    survives. A cache may also "colour" its slabs: the 1st object of each
+    slab is shifted by a different # of cache lines (using the slab's
+    leftover space), so that hot fields of objects in different slabs don't
+    all map to the same cache sets.
+    - empty slabs go back to the region (beyond a few kept per cache), and
+    may then become slabs of any cache. A SLAB_TYPESAFE cache keeps them
+    until destroyed: a stale pointer to a freed object still points to an
+    object of that type, which lock-free lookups may rely on (cf timer.c).
+    - each cpu has a small LIFO stack of free objects per cache (struct
+    array_cache). alloc/free only touch that stack, with irq off and no lock;
+    only when it runs empty (full) is a batch of objects moved from (to) the
+    slabs, under the cache's lock. All operations are O(1).
+    - kfree() finds the slab, hence the cache, by rounding the pointer down
+    to the page.
+    - kmalloc() has power-of-2 size classes from a cache line up to
+    KMALLOC_MAX_SLAB; larger requests go to the page allocator.
+
+    slab_stats() prints usage and fragmentation per cache.
+
+    Caches of hot objects: "pipe", "msgchan". cf kmem_cache_create() callers
+*/
+
+#include "plat.h"
+#include "utils.h"
+#include "slab.h"
+
+/* at the start of each slab page */
+struct slab {
+    struct list_head list;      // on one of the cache's slab lists
+    struct kmem_cache *cache;
+    char *s_mem;                // the 1st object, after the colour offset
+    unsigned nfree;             // # of free objects. top of freeidx[]
+    unsigned char freeidx[];    // stack of free object indices. @num entries
+};
+
+#define ALIGN_UP(x, a)  (((x) + (a) - 1) & ~((unsigned long)(a) - 1))
+
+/* empty slabs kept per cache; beyond that, pages go back to the region */
+#define SLAB_MAX_EMPTY  1
+
+/* ------------- slab pages: the malloc region ---------- */
+
+/* the region is a free list of pages; a page is a slab or free */
+static struct spinlock region_lock = {.locked=0, .cpu=0, .name="slab_region"};
+static unsigned long region_start, region_end;  // pa
+static void *region_free;       // free pages, linked through 1st word
+static unsigned long region_nfree;
+
+static inline int in_region(const void *p) {
+    return (unsigned long)p >= region_start && (unsigned long)p < region_end;
+}
+
+static void *region_get_page(void) {
+    void *page;
+    acquire(&region_lock);
+    page = region_free;
+    if (page) {
+        region_free = *(void **)page;
+        region_nfree--;
+    }
+    release(&region_lock);
+    return page;
+}
+
+static void region_put_page(void *page) {
+    acquire(&region_lock);
+    *(void **)page = region_free;
+    region_free = page;
+    region_nfree++;
+    release(&region_lock);
+}
+
+/* ------------- caches ---------- */
+
+static struct kmem_cache cache_cache;   // where struct kmem_cache come from
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASSES];
+static char kmalloc_names[KMALLOC_NCLASSES][16];
+
+static LIST_HEAD(cache_list);           // all caches. for stats
+static struct spinlock cache_list_lock = {.locked=0, .cpu=0, .name="cache_list"};
+
+static void cache_init(struct kmem_cache *c, const char *name, unsigned size,
+                       unsigned align, void (*ctor)(void *), unsigned flags) {
+    unsigned left;
+
+    memset(c, 0, sizeof(*c));
+    initlock(&c->lock, "kmem_cache");
+    INIT_LIST_HEAD(&c->partial);
+    INIT_LIST_HEAD(&c->full);
+    INIT_LIST_HEAD(&c->empty);
+    c->name = name;
+    c->ctor = ctor;
+    c->flags = flags;
+    c->align = MAX(align, (unsigned)CACHE_LINE_SIZE);
+    BUG_ON(c->align & (c->align - 1));
+    c->size = ALIGN_UP(size, c->align);
+
+    // slab header (incl. 1 byte per object) + objects must fit in a page
+    c->num = (PAGE_SIZE - sizeof(struct slab)) / (c->size + 1);
+    while (c->num && ALIGN_UP(sizeof(struct slab) + c->num, c->align)
+            + c->num * c->size > PAGE_SIZE)
+        c->num--;
+    BUG_ON(!c->num || c->num > 255);
+    c->offset = ALIGN_UP(sizeof(struct slab) + c->num, c->align);
+
+    left = PAGE_SIZE - c->offset - c->num * c->size;
+    c->colour = (flags & SLAB_COLOUR) ? left / c->align + 1 : 1;
+
+    acquire(&cache_list_lock);
+    list_add_tail(&c->next, &cache_list);
+    release(&cache_list_lock);
+}
+
+/* create a cache of objects of @size bytes, aligned to @align (at least a
+cache line). @ctor (optional) must not sleep or allocate from this cache.
+@flags: SLAB_COLOUR or 0. return 0 on failure */
+struct kmem_cache *kmem_cache_create(const char *name, unsigned size,
+        unsigned align, void (*ctor)(void *), unsigned flags) {
+    struct kmem_cache *c;
+
+    if (!size || size > PAGE_SIZE / 2 || (align & (align - 1)))
+        {W("%s: bad size %u align %u", name, size, align); return 0;}
+    if (!(c = kmem_cache_alloc(&cache_cache)))
+        return 0;
+    cache_init(c, name, size, align, ctor, flags);
+    I("cache %s: size %u num %u colours %u", name, c->size, c->num, c->colour);
+    return c;
+}
+
+static inline void *slab_obj(struct kmem_cache *c, struct slab *s, unsigned idx) {
+    return s->s_mem + idx * c->size;
+}
+
+/* add a slab to @c. caller must hold c->lock. return 0 if out of pages */
+static struct slab *cache_grow(struct kmem_cache *c) {
+    struct slab *s = region_get_page();
+
+    if (!s)
+        return 0;
+    s->cache = c;
+    s->s_mem = (char *)s + c->offset + c->colour_next * c->align;
+    if (++c->colour_next == c->colour)
+        c->colour_next = 0;
+    // objects are handed out in address order
+    for (unsigned i = 0; i < c->num; i++)
+        s->freeidx[i] = c->num - 1 - i;
+    s->nfree = c->num;
+    if (c->ctor)
+        for (unsigned i = 0; i < c->num; i++)
+            c->ctor(slab_obj(c, s, i));
+    list_add(&s->list, &c->empty);
+    c->nr_slabs++;
+    return s;
+}
+
+/* move a batch of objects from the slabs to @ac. caller must hold c->lock */
+static void cache_refill(struct kmem_cache *c, struct array_cache *ac) {
+    struct slab *s;
+
+    c->nr_refills++;
+    while (ac->avail < SLAB_AC_BATCH) {
+        if (!list_empty(&c->partial))
+            s = list_first_entry(&c->partial, struct slab, list);
+        else if (!list_empty(&c->empty))
+            s = list_first_entry(&c->empty, struct slab, list);
+        else if (!(s = cache_grow(c)))
+            break;  // out of memory. hand out what we have
+
+        while (ac->avail < SLAB_AC_BATCH && s->nfree) {
+            ac->entry[ac->avail++] = slab_obj(c, s, s->freeidx[--s->nfree]);
+            c->nr_active++;
+        }
+        list_del(&s->list);
+        list_add(&s->list, s->nfree ? &c->partial : &c->full);
+    }
+}
+
+/* put an object back to its slab. caller must hold c->lock */
+static void slab_put_obj(struct kmem_cache *c, void *obj) {
+    struct slab *s = (struct slab *)PGROUNDDOWN((unsigned long)obj);
+    unsigned idx = ((char *)obj - s->s_mem) / c->size;
+
+    BUG_ON(s->cache != c || s->nfree == c->num || slab_obj(c, s, idx) != obj);
+    s->freeidx[s->nfree++] = idx;
+    c->nr_active--;
+
+    list_del(&s->list);
+    if (s->nfree < c->num)
+        list_add(&s->list, &c->partial);
+    else
+        list_add(&s->list, &c->empty);
+}
+
+/* release empty slabs beyond @keep. caller must hold c->lock */
+static void cache_trim(struct kmem_cache *c, int keep) {
+    struct list_head *l, *n;
+    list_for_each_safe(l, n, &c->empty) {
+        if (keep > 0)
+            {keep--; continue;}
+        list_del(l);
+        c->nr_slabs--;
+        region_put_page(list_entry(l, struct slab, list));
+    }
+}
+
+/* move the coldest @n objects from @ac to the slabs.
+caller must hold c->lock */
+static void cache_flush(struct kmem_cache *c, struct array_cache *ac, int n) {
+    n = MIN(ac->avail, n);
+    c->nr_flushes++;
+    for (int i = 0; i < n; i++)
+        slab_put_obj(c, ac->entry[i]);
+    ac->avail -= n;
+    memmove(ac->entry, ac->entry + n, ac->avail * sizeof(void *));
+    if (!(c->flags & SLAB_TYPESAFE))
+        cache_trim(c, SLAB_MAX_EMPTY);
+}
+
+/* destroy a cache. all objects must have been freed. return 0 on success */
+int kmem_cache_destroy(struct kmem_cache *c) {
+    acquire(&c->lock);
+    for (int i = 0; i < NCPU; i++)
+        cache_flush(c, &c->cpu[i], SLAB_AC_LIMIT);
+    if (c->nr_active) {
+        W("%s: %lu objects still in use", c->name, c->nr_active);
+        release(&c->lock);
+        return -1;
+    }
+    cache_trim(c, 0);
+    release(&c->lock);
+
+    acquire(&cache_list_lock);
+    list_del(&c->next);
+    release(&cache_list_lock);
+    kmem_cache_free(&cache_cache, c);
+    return 0;
+}
+
+/* return 0 if out of memory */
+void *kmem_cache_alloc(struct kmem_cache *c) {
+    struct array_cache *ac;
+    void *obj = 0;
+
+    push_off();     // ac is ours as long as we stay on this cpu w/o irq
+    ac = &c->cpu[cpuid()];
+    if (!ac->avail) {
+        acquire(&c->lock);
+        cache_refill(c, ac);
+        release(&c->lock);
+    }
+    if (ac->avail) {
+        obj = ac->entry[--ac->avail];
+        ac->allocs++;
+    }
+    pop_off();
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj) {
+    struct array_cache *ac;
+
+    push_off();
+    ac = &c->cpu[cpuid()];
+    if (ac->avail == SLAB_AC_LIMIT) {
+        acquire(&c->lock);
+        cache_flush(c, ac, SLAB_AC_BATCH);
+        release(&c->lock);
+    }
+    ac->entry[ac->avail++] = obj;
+    ac->frees++;
+    pop_off();
+}
+
+/* ------------- kmalloc ---------- */
+
+/* beyond KMALLOC_MAX_SLAB: whole pages, after a cache line of header */
+struct large_hdr {
+    unsigned long magic;
+    unsigned order;
+};
+#define LARGE_MAGIC     0x6c61726765UL  // "large"
+
+static inline int kmalloc_index(unsigned long size) {
+    int shift = KMALLOC_MIN_SHIFT;
+    while ((1UL << shift) < size)
+        shift++;
+    return shift - KMALLOC_MIN_SHIFT;
+}
+
+/* allocate @size bytes, cache line aligned, NOT zeroed.
+return 0 on failure (or @size==0) */
+void *kmalloc(unsigned long size) {
+    struct large_hdr *h;
+    unsigned order = 0;
+
+    if (!size)
+        return 0;
+    if (size <= KMALLOC_MAX_SLAB)
+        return kmem_cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
+
+    while ((1UL << (PAGE_SHIFT + order)) < size + CACHE_LINE_SIZE)
+        if (++order >= MAX_ORDER)
+            return 0;   // larger than any buddy block
+    if (!(h = (struct large_hdr *)alloc_pages(order)))
+        return 0;
+    h->magic = LARGE_MAGIC;
+    h->order = order;
+    return (char *)h + CACHE_LINE_SIZE;
+}
+
+void *kzalloc(unsigned long size) {
+    void *p = kmalloc(size);
+    if (p)
+        memzero(p, size);
+    return p;
+}
+
+void kfree(void *p) {
+    struct large_hdr *h;
+
+    if (!p)
+        return;
+    if (in_region(p)) {
+        kmem_cache_free(((struct slab *)PGROUNDDOWN((unsigned long)p))->cache, p);
+        return;
+    }
+    h = (struct large_hdr *)((char *)p - CACHE_LINE_SIZE);
+    BUG_ON(h->magic != LARGE_MAGIC);
+    h->magic = 0;
+    free_pages((unsigned long)h, h->order);
+}
+
+/* ------------- stats & init ---------- */
+
+/* usage: objects handed out to callers, vs. the slab memory holding them.
+fragmentation: % of slab memory not holding any object in use, i.e.
+per-slab leftover + free objects in slabs and per-cpu caches */
+static void cache_stats(struct kmem_cache *c) {
+    unsigned long cached = 0, allocs = 0, frees = 0, inuse, total, frag;
+
+    acquire(&c->lock);
+    for (int i = 0; i < NCPU; i++) {
+        cached += c->cpu[i].avail;
+        allocs += c->cpu[i].allocs;
+        frees += c->cpu[i].frees;
+    }
+    inuse = c->nr_active - cached;
+    total = c->nr_slabs * PAGE_SIZE;
+    frag = total ? 100 - inuse * c->size * 100 / total : 0;
+    printf("%12s %5u %4u %6lu %8lu %8lu %4lu%% %8lu %8lu %6lu\n",
+        c->name, c->size, c->num, c->nr_slabs, inuse, c->nr_slabs * c->num,
+        frag, allocs, frees, c->nr_refills + c->nr_flushes);
+    release(&c->lock);
+}
+
+void slab_stats(void) {
+    struct list_head *l;
+
+    printf("%12s %5s %4s %6s %8s %8s %5s %8s %8s %6s\n", "cache", "size",
+        "num", "slabs", "inuse", "total", "frag", "allocs", "frees", "slow");
+    acquire(&cache_list_lock);
+    list_for_each(l, &cache_list)
+        cache_stats(list_entry(l, struct kmem_cache, next));
+    release(&cache_list_lock);
+    printf("malloc region: %lu/%lu pages free\n", region_nfree,
+        (region_end - region_start) >> PAGE_SHIFT);
+}
+
+/* @base: pa of the malloc region (reserved by caller), @npages pages */
+void kmem_init(unsigned long base, unsigned long npages) {
+    region_start = base;
+    region_end = base + npages * PAGE_SIZE;
+    // low addresses first
+    for (unsigned long pa = region_end; pa > region_start; )
+        {pa -= PAGE_SIZE; region_put_page((void *)pa);}
+
+    cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache),
+        CACHE_LINE_SIZE, 0, 0);
+    for (int i = 0; i < KMALLOC_NCLASSES; i++) {
+        unsigned size = 1U << (i + KMALLOC_MIN_SHIFT);
+        snprintf(kmalloc_names[i], sizeof(kmalloc_names[i]), "kmalloc-%u", size);
+        cache_init(&kmalloc_caches[i], kmalloc_names[i], size,
+            CACHE_LINE_SIZE, 0, 0);
+    }
+    I("kmem: region %lx--%lx, %d size classes", region_start, region_end,
+        KMALLOC_NCLASSES);
+}
@@ -0,0 +1,51 @@
+// Slab allocator: kmalloc()/kfree() and object caches. cf slab.c
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "plat.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "list.h"
+
+/* per-cpu stack of free objects, in front of the slabs */
+struct array_cache {
+  int avail;                    // # of objects in entry[]
+  unsigned long allocs, frees;  // # of calls on this cpu (stats)
+  void *entry[SLAB_AC_LIMIT];   // LIFO: entry[avail-1] is the hottest
+};
+
+struct kmem_cache {
+  struct spinlock lock;         // protects the slab lists & counters below
+  struct list_head partial;     // slabs with some free objects
+  struct list_head full;        // slabs without free objects
+  struct list_head empty;       // slabs without allocated objects
+  unsigned size;                // object size, multiple of align
+  unsigned align;               // object alignment, >= CACHE_LINE_SIZE
+  unsigned num;                 // # of objects per slab
+  unsigned offset;              // offset of the 1st object in a slab page
+  unsigned colour;              // # of colours: distinct offsets for the 1st object
+  unsigned colour_next;         // colour of the next slab
+  void (*ctor)(void *obj);      // once per object, when its slab is created
+  unsigned flags;               // SLAB_xxx below
+  unsigned long nr_slabs;       // # of slab pages
+  unsigned long nr_active;      // # of objects out of slabs (incl. per-cpu cached)
+  unsigned long nr_refills, nr_flushes;  // # of batches moved from/to slabs
+  const char *name;
+  struct list_head next;        // on the list of all caches
+  struct array_cache cpu[NCPU] __cacheline_aligned;
+};
+
+/* flags for kmem_cache_create() */
+#define SLAB_COLOUR     0x1     // stagger objects across slabs by cache lines
+#define SLAB_TYPESAFE   0x2     // slab pages never leave the cache: a freed
+                                // object's memory stays of this type
+
+/* kmalloc size classes: 64, 128, .. KMALLOC_MAX_SLAB. larger ones are
+served by alloc_pages() */
+#define KMALLOC_MIN_SHIFT   CACHE_LINE_SHIFT
+#define KMALLOC_MAX_SHIFT   10
+#define KMALLOC_MAX_SLAB    (1 << KMALLOC_MAX_SHIFT)
+#define KMALLOC_NCLASSES    (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+#endif
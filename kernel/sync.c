@@ -0,0 +1,211 @@
+// #define K2_DEBUG_VERBOSE
+// #define K2_DEBUG_INFO
+#define K2_DEBUG_WARN
+
+/*
+    Semaphores, completions, and condition variables.
+
+    All are built on sleep()/wakeup() (sched.c) and follow the same locking
+    protocol: a waiter sleeps with the primitive's lock (or, for condvars, the
+    caller's lock) held; a waker calls wakeup_n() with that lock held. So no
+    wakeup can be lost.
+
+    Wakers may wake one task, N tasks, or all tasks. Producers are encouraged
+    to signal once per batch of items (e.g. sema_up_n()) rather than once per
+    item: each wakeup scans the whole task table under sched_lock. For the
+    same reason, wakeup is skipped entirely if nobody is waiting.
+
+    Waiters may specify a timeout (in ms), cf sleep_timeout().
+*/
+
+#include "utils.h"
+#include "sched.h"
+#include "sync.h"
+
+/* sleep on @chan with @lk held, until @deadline (in current_time_ms()).
+return 0 if woken up, -1 if the deadline has passed */
+static int sleep_until(void *chan, struct spinlock *lk, unsigned long deadline) {
+    unsigned long now = current_time_ms();
+    if (now >= deadline)
+        return -1;
+    return sleep_timeout(chan, lk, (unsigned)(deadline - now));
+}
+
+/* -------------  semaphore  -------------------- */
+
+void sema_init(struct semaphore *s, int count, char *name) {
+    initlock(&s->lock, name);
+    s->count = count;
+    s->nwaiters = 0;
+}
+
+void sema_down(struct semaphore *s) {
+    acquire(&s->lock);
+    while (s->count <= 0) {
+        s->nwaiters++;
+        sleep(s, &s->lock);
+        s->nwaiters--;
+    }
+    s->count--;
+    release(&s->lock);
+}
+
+/* return 0 on success, -1 if timed out (count untouched) */
+int sema_down_timeout(struct semaphore *s, unsigned ms) {
+    unsigned long deadline = current_time_ms() + ms;
+    int ret = 0;
+
+    acquire(&s->lock);
+    while (s->count <= 0) {
+        s->nwaiters++;
+        ret = sleep_until(s, &s->lock, deadline);
+        s->nwaiters--;
+        if (ret < 0 && s->count <= 0)
+            goto out;
+    }
+    s->count--;
+    ret = 0;
+out:
+    release(&s->lock);
+    return ret;
+}
+
+/* return 0 on success, -1 if count is 0. never sleeps */
+int sema_trydown(struct semaphore *s) {
+    int ret = -1;
+    acquire(&s->lock);
+    if (s->count > 0)
+        {s->count--; ret = 0;}
+    release(&s->lock);
+    return ret;
+}
+
+/* release @n units at once, waking up at most @n waiters (one table scan) */
+void sema_up_n(struct semaphore *s, int n) {
+    BUG_ON(n < 0);
+    acquire(&s->lock);
+    s->count += n;
+    if (s->nwaiters)
+        wakeup_n(s, n);
+    release(&s->lock);
+}
+
+void sema_up(struct semaphore *s) {
+    sema_up_n(s, 1);
+}
+
+/* -------------  completion  -------------------- */
+
+void init_completion(struct completion *c, char *name) {
+    initlock(&c->lock, name);
+    c->done = 0;
+    c->nwaiters = 0;
+}
+
+/* rearm a completion for reuse. caller must ensure no waiters */
+void reinit_completion(struct completion *c) {
+    acquire(&c->lock);
+    c->done = 0;
+    release(&c->lock);
+}
+
+/* consume one "done". caller must hold c->lock and c->done != 0 */
+static inline void completion_consume(struct completion *c) {
+    if (c->done != COMPLETION_ALL)
+        c->done--;
+}
+
+void wait_for_completion(struct completion *c) {
+    acquire(&c->lock);
+    while (!c->done) {
+        c->nwaiters++;
+        sleep(c, &c->lock);
+        c->nwaiters--;
+    }
+    completion_consume(c);
+    release(&c->lock);
+}
+
+/* return 0 on success, -1 if timed out */
+int wait_for_completion_timeout(struct completion *c, unsigned ms) {
+    unsigned long deadline = current_time_ms() + ms;
+    int ret = 0;
+
+    acquire(&c->lock);
+    while (!c->done) {
+        c->nwaiters++;
+        ret = sleep_until(c, &c->lock, deadline);
+        c->nwaiters--;
+        if (ret < 0 && !c->done)
+            goto out;
+    }
+    completion_consume(c);
+    ret = 0;
+out:
+    release(&c->lock);
+    return ret;
+}
+
+/* signal @n events, waking up at most @n waiters */
+void complete_n(struct completion *c, int n) {
+    BUG_ON(n < 0);
+    acquire(&c->lock);
+    if (c->done != COMPLETION_ALL)
+        c->done += n;
+    if (c->nwaiters)
+        wakeup_n(c, n);
+    release(&c->lock);
+}
+
+void complete(struct completion *c) {
+    complete_n(c, 1);
+}
+
+/* wake up all current and future waiters, until reinit_completion() */
+void complete_all(struct completion *c) {
+    acquire(&c->lock);
+    c->done = COMPLETION_ALL;
+    if (c->nwaiters)
+        wakeup(c);
+    release(&c->lock);
+}
+
+/* -------------  condition variable  -------------------- */
+
+void cv_init(struct condvar *cv, char *name) {
+    cv->name = name;
+    cv->nwaiters = 0;
+}
+
+/* atomically release @lk and sleep; reacquire @lk before return.
+as usual, the caller shall recheck its condition in a loop */
+void cv_wait(struct condvar *cv, struct spinlock *lk) {
+    cv->nwaiters++;
+    sleep(cv, lk);
+    cv->nwaiters--;
+}
+
+/* return 0 if signaled, -1 if timed out */
+int cv_wait_timeout(struct condvar *cv, struct spinlock *lk, unsigned ms) {
+    int ret;
+    cv->nwaiters++;
+    ret = sleep_timeout(cv, lk, ms);
+    cv->nwaiters--;
+    return ret;
+}
+
+/* wake up at most @n waiters. caller must hold the lock used by waiters.
+return # of tasks woken up */
+int cv_signal_n(struct condvar *cv, int n) {
+    if (!cv->nwaiters)
+        return 0;
+    return wakeup_n(cv, n);
+}
+
+int cv_signal(struct condvar *cv) {
+    return cv_signal_n(cv, 1);
+}
+
+int cv_broadcast(struct condvar *cv) {
+    return cv_signal_n(cv, -1);
+}
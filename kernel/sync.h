@@ -0,0 +1,30 @@
+// Sleeping synchronization primitives atop sleep()/wakeup(). cf sync.c
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "spinlock.h"
+
+/* counting semaphore */
+struct semaphore {
+  struct spinlock lock;   // protects members below
+  int count;              // # of available units
+  int nwaiters;           // # of tasks sleeping in sema_down()
+};
+
+/* one-shot (or counted) event, e.g. "the child has finished its work" */
+struct completion {
+  struct spinlock lock;   // protects members below
+  unsigned done;          // # of pending complete(). COMPLETION_ALL after complete_all()
+  int nwaiters;
+};
+#define COMPLETION_ALL  (~0U)
+
+/* condition variable, to be used with a caller-provided spinlock (the same
+  lock must be held across cv_wait()/cv_signal()). Protected by that lock */
+struct condvar {
+  char *name;             // debugging
+  int nwaiters;           // # of tasks sleeping in cv_wait()
+};
+
+#endif
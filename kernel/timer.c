@@ -8,27 +8,38 @@
 #include "printf.h"
 #include "spinlock.h"
 #include "sched.h"
+#include "slab.h"
+#include "timer.h"
 
 // Use of harware timers 
-// - Per-core "arm generic timers": driving scheduler ticks
-// - Chip-level "arm system timer": timekeeping, virtual timers w/ callbacks,
-//   sys_sleeep(), etc. 
-// It's possible to only use "arm generic timer" for all these purposes like
-// xv6 (+ software tricks like sched tick throttling, distinguishing timers on
-// different cpus, etc) which however result in more complex design. 
-
-// Sched ticks should occur periodically, but not too often -- otherwise 
-// numerous nested calls to schedule() will exhaust & corrupt the kernel state. 
-// So be careful when you change the HZ below 
-// 10Hz assumed by some code in usertests.c
-#define SCHED_TICK_HZ	10
-// sys_sleep() based on sched ticks -- too coarse grained for certain apps, e.g.
-// NES emulator relies on sys_sleep() to sleep/wake at 60Hz for its rendering.
-
-/* sched interval, for arm generic timer. 
-when on qemu, arm generic timer is at 1MHz by default
-on rpi3, it's also 1MHz. */
-int interval = (1 * 1000 * 50 / SCHED_TICK_HZ);
+// - Per-core "arm generic timers": driving scheduler ticks (CNTP), and 
+//   virtual timers w/ callbacks (CNTV). 
+// - The generic counter behind them: timekeeping (ktime_get_ns() etc.), 
+//   and bounding busy waits
+// - Chip-level "arm system timer": unused, cf below
+
+// Sched ticks should occur periodically. Nested calls to schedule() can't 
+// pile up on a kernel stack, whatever the rate: irq handlers, and so 
+// schedule() from timer_tick(), run w/ irq off (pop_off() only restores it),
+// so a task switched away in a tick holds one irq frame. The only place 
+// irq is turned on inside a handler is the timer softirq (cf below), and 
+// an irq nested there neither schedules (timer_tick() checks in_softirq) 
+// nor starts another softirq: at most two irq frames per stack. A faster 
+// tick costs cpu time, not stack. 
+// The rate is SCHED_TICK_HZ at boot, and can be changed at run time 
+// (cf set_sched_tick_hz()) within [SCHED_TICK_HZ_MIN, SCHED_TICK_HZ_MAX]. 
+// Task credits are scaled to it (cf sched.c), so a timeslice lasts as long
+// at any rate; a faster tick only wakes up idle cpus sooner, at the cost of
+// more irqs. Timeouts no longer depend on it: they are on vtimers. 
+
+unsigned sched_tick_hz = SCHED_TICK_HZ; 
+
+static unsigned long cntfrq; 		// generic counter, Hz. cf ktime_init()
+static unsigned long cnt_per_ms; 
+
+/* sched interval, for arm generic timer, in counter ticks. the counter 
+is not 1MHz (19.2MHz on rpi3, 62.5MHz on qemu): from CNTFRQ */
+static unsigned long interval; 
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -57,7 +68,11 @@ void generic_timer_init (void) {
 	// 	_EL0: timer accessible to both EL1 and EL0
 	asm volatile("msr CNTP_CTL_EL0, %0" : : "r"(1));
 
+	if (!interval) 	// cntfrq known, cf sys_timer_init()
+		interval = cntfrq / sched_tick_hz; 
 	generic_timer_reset(interval);	// kickoff 1st time firing
+
+	generic_vtimer_init(); 	// the virtual timer: vtimers, cf below
 }
 
 //Q3: quest: "two preemptive printers"
@@ -78,251 +93,966 @@ void handle_generic_timer_irq(void)  {
 	timer_tick();
 }
 
+/* change the sched tick rate, on all cpus, from their next ticks on. 
+return 0 on success, -1 if @hz is out of range */
+int set_sched_tick_hz(unsigned hz) {
+	if (hz < SCHED_TICK_HZ_MIN || hz > SCHED_TICK_HZ_MAX)
+		return -1; 
+	sched_tick_hz = hz; 	// credits are scaled from now on, cf sched.c
+	interval = cntfrq / hz; 
+	I("sched tick %u Hz", hz); 
+	return 0; 
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-/* 
-	Rpi3's "system Timer". 
-	- Support "virtual timers" and timekeeping (current_time(), sys_sleep()). 
-	- Efficient. No periodic interrupts. Instead, set & fire on demand. 
-	- IRQ always routed to core 0.
+/* Timekeeping: the Arm generic counter, a 64-bit count since power on at
+CNTFRQ_EL0 Hz, the same on all cores. A read is one system register 
+access (vs. two uncached MMIO reads of the sys timer, racy when its low
+word wraps), and never wraps in practice. 
 
-	cf: test_ktimer() on how to use.
+Counts are converted by multiply & shift, w/ factors computed once at 
+boot: ns = cnt * mult >> 32, where mult = 10^9 * 2^32 / CNTFRQ. The 
+product is 128-bit (mul + umulh), so no range limit; the error is one 
+part in 2^32 of mult, i.e. < 1ns per 4 sec at 1MHz. No division. */
 
-	NB: in earlier qemu (<5), emulation for system timer is incomplete --
-	cannot fire interrupts. 
-	https://fxlin.github.io/p1-kernel/exp3/rpi-os/#fyi-other-timers-on-rpi3		
+static unsigned long cnt_mult_ns, cnt_mult_us, cnt_mult_ms; 
+#define CNT_SHIFT 	32
 
-*/
-#if defined(PLAT_RPI3) || defined(PLAT_RPI3QEMU)
-#define N_TIMERS 20 	// # of vtimers
-#define CLOCKHZ	1000000	// rpi3 use 1MHz clock for system counter. 
+/* the generic counter, as seen by CNTV. CNTVOFF_EL2 is 0 (cf boot.S), so
+the same as CNTPCT_EL0. the isb: not read ahead of preceding code */
+static inline unsigned long arch_counter(void) {
+	unsigned long cnt; 
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r" (cnt) :: "memory"); 
+	return cnt; 
+}
+
+// round up, so that a deadline never fires early
+static inline unsigned long us_to_cnt(unsigned long us) {
+	return us / 1000000 * cntfrq + (us % 1000000 * cntfrq + 999999) / 1000000; 
+}
 
-#define TICKPERSEC (CLOCKHZ)
-#define TICKPERMS (CLOCKHZ / 1000)
-#define TICKPERUS (CLOCKHZ / 1000 / 1000)
+static inline unsigned long cnt_scale(unsigned long cnt, unsigned long mult) {
+	return ((unsigned __int128)cnt * mult) >> CNT_SHIFT; 
+}
+
+static void delay_calibrate(void); 
+
+static void ktime_init(void) {
+	asm volatile("mrs %0, cntfrq_el0" : "=r" (cntfrq)); 
+	BUG_ON(cntfrq < 1000); 
+	cnt_per_ms = cntfrq / 1000; 
+	cnt_mult_ns = (1000000000UL << CNT_SHIFT) / cntfrq; 
+	cnt_mult_us = (1000000UL << CNT_SHIFT) / cntfrq; 
+	cnt_mult_ms = (1000UL << CNT_SHIFT) / cntfrq; 
+	I("generic counter %lu Hz, ns mult %lu >> %d", cntfrq, cnt_mult_ns, 
+		CNT_SHIFT); 
+	delay_calibrate(); 
+}
 
-// return # of ticks (=us when clock is 1MHz)
-// NB: use current_time() below to get converted time
-static inline unsigned long current_counter() {
-	// assume these two are consistent, since the clock is only 1MHz...
-	return ((unsigned long) get32(TIMER_CHI) << 32) | get32(TIMER_CLO); 
+// since boot (power on), monotonic. any context 
+unsigned long ktime_get_ns(void) {
+	return cnt_scale(arch_counter(), cnt_mult_ns); 
+}
+
+unsigned long ktime_get_us(void) {
+	return cnt_scale(arch_counter(), cnt_mult_us); 
+}
+
+// 111.222
+void current_time(unsigned *sec, unsigned *msec) {
+	unsigned long ms = current_time_ms(); 
+	*sec = (unsigned) (ms / 1000); 
+	*msec = (unsigned) (ms % 1000); 
+}
+
+// same as above, in ms. handy for computing deadlines
+unsigned long current_time_ms(void) {
+	return cnt_scale(arch_counter(), cnt_mult_ms); 
 }
 
 //////////////////////////////
-//  delay, timekeeping 
-
-// # of cpu cycles per ms, per us. measured. will be tuned during boot
-#ifdef PLAT_RPI3
-/*  cache on */
-// static unsigned int cycles_per_ms = 602409;
-// static unsigned int cycles_per_us = 599; 
-/* cache off, much slower */
-static unsigned int cycles_per_ms = 5011;
-static unsigned int cycles_per_us = 5; 
-#elif defined(PLAT_RPI3QEMU)
-/* cache off: */
-static unsigned int cycles_per_ms = 434782;
-static unsigned int cycles_per_us = 434; 
-#endif
-
-// use sys timer to measure: # of cpu cycles per ms 
-// can be slow if cache is off
-__attribute__((unused))
-static void sys_timer_tune_delay() {
-	unsigned long cur0 = current_counter(), ms, us; 
-	unsigned long ncycles = 100 * 1000 * 1000; 	// run 100M cycles. delay should >1ms
-	delay(ncycles); 	
-	us = (current_counter() - cur0) / TICKPERUS; 
-	ms = us / 1000; 
-
-	cycles_per_us = ncycles / us; 
-	cycles_per_ms = ncycles / ms; 
-	I("cycles_per_us %u cycles_per_ms %u", cycles_per_us, cycles_per_ms);
+//  delay 
+
+/* Busy waits are bounded by the generic counter: right whatever the cpu
+clock, caches on or off, or qemu's host speed; and irqs taken meanwhile 
+do not make them longer. Only spins below a us, finer than what the 
+counter may resolve (1MHz on rpi3), count delay() loops, whose rate is 
+measured against the counter at boot (irq off, a few ms at most). */
+
+static unsigned long loops_per_ms; 
+
+static void delay_calibrate(void) {
+	unsigned long loops = 1 << 12, t0, t1; 
+
+	do {	// long enough for the counter's resolution 
+		loops <<= 1; 
+		t0 = arch_counter(); 
+		delay(loops); 
+		t1 = arch_counter(); 
+	} while (t1 - t0 < cnt_per_ms); 
+	loops_per_ms = loops * cnt_per_ms / (t1 - t0); 
+	BUG_ON(!loops_per_ms); 
+	I("delay loops per ms %lu", loops_per_ms); 
 }
 
 void ms_delay(unsigned ms) {
-	BUG_ON(!cycles_per_ms);
-	delay(cycles_per_ms * ms); 
+	unsigned long end; 
+
+	BUG_ON(!cnt_per_ms);
+	end = arch_counter() + cnt_per_ms * ms; 
+	while (arch_counter() < end)
+		; 
 }
 
 void us_delay(unsigned us) {
-	BUG_ON(!cycles_per_us);
-	delay(cycles_per_us * us); 
+	unsigned long end; 
+
+	BUG_ON(!cnt_per_ms);
+	end = arch_counter() + us_to_cnt(us); 
+	while (arch_counter() < end)
+		; 
 }
 
-// can only be called after va is on, timers are init'd
-// 111.222
-void current_time(unsigned *sec, unsigned *msec) {
-	unsigned long cur = current_counter();
-	*sec =  (unsigned) (cur / TICKPERSEC); 
-	cur -= (*sec) * TICKPERSEC; 
-	*msec = (unsigned) (cur / TICKPERMS);	
+// sub-us spins, e.g. device setup/hold times. longer ones: us_delay()
+void ns_delay(unsigned ns) {
+	BUG_ON(!loops_per_ms); 
+	if (ns >= 1000) {
+		us_delay((ns + 999) / 1000); 
+		return; 
+	}
+	delay(loops_per_ms * ns / 1000000 + 1); 
 }
 
+#if defined(PLAT_RPI3) || defined(PLAT_RPI3QEMU)
 //////////////////////////////
 // virtual kernel timers 
-struct spinlock timerlock;
 
-struct vtimer {
+/* Each cpu has its own timer base: a queue of pending vtimers, driven by
+the cpu's own Arm generic *virtual* timer (CNTV, the physical one drives
+sched ticks). A timer is queued on the cpu that starts it and fires there;
+no cross-core irq, and the base lock is contended only by cancels from
+other cpus. (The sys timer's irq only reaches core 0, and its channels 
+C0/C2 belong to the GPU, so it no longer backs vtimers. The kernel no
+longer uses it at all.) Expiry is in generic counter ticks (CNTVCT_EL0).
+CNTV_CVAL_EL0 is a 64-bit absolute compare value: an expiry already in 
+the past simply fires right away.
+
+Pending vtimers are kept in a binary min-heap, ordered by expiry: heap[0]
+is the earliest, so finding what to program into CNTV is O(1); insert and 
+cancel (by the heap index each timer keeps) are O(log n). The heap array
+grows by doubling, i.e. no limit on # of timers. 
+
+Callbacks do not run in the vtimer irq handler itself: it only moves the
+expired timers to the base's expired list, under the lock. They run right
+after, as a "softirq": on the same cpu and stack, but w/ irq on and no 
+timer lock held. So irqs are masked only for the heap operations, and a 
+callback may start (re-arm) or cancel timers. Timer irqs that nest inside 
+the softirq just queue more expired timers for it; the sched tick does 
+not preempt it. A timer that is expired but whose callback has not run 
+yet can still be cancelled.
+
+Slack & coalescing: a timer may fire anywhere in [elapseat, latest], 
+where latest = elapseat + its slack (0 by default, cf ktimer_start_range()).
+The heap is ordered by the latest, which is what CNTV is programmed with; 
+when it fires, every timer at the top of the heap whose window has opened
+fires with it. So timers w/ overlapping windows (background housekeeping,
+stats sampling..) share one irq. Like linux's hrtimers, the walk stops at
+the first timer whose window is not open yet, i.e. coalescing is best 
+effort. Each timer that fires before its latest saves an irq; cf
+ktimer_stats().
+
+Timer objects come from a type-safe slab cache (SLAB_TYPESAFE, never 
+destroyed): its slab pages are never handed to other caches, so a timer's
+memory stays a struct ktimer, even after the timer fires or is cancelled;
+the ctor makes even never used objects look idle. A handle is the object's
+address plus a sequence number, so a stale handle (whose timer is gone, its
+object possibly reused) is told apart cheaply, and its base pointer is 
+always a real base (or 0) */
+
+struct ktimer {
 	TKernelTimerHandler *handler; 
-	unsigned long elapseat; 	// sys timer ticks (=us)
+	unsigned long elapseat; 	// generic counter ticks. earliest to fire
+	unsigned long latest; 		// elapseat + slack. the heap's key
 	void *param; 
 	void *context; 
+	int idx; 					// in base->heap[], or KT_xxx below
+	unsigned seq; 				// cf ktimer_handle()
+	struct timer_base *base; 	// whose heap it is on
+	struct list_head entry; 	// on base->expired
 }; 
-static struct vtimer timers[N_TIMERS]; 
+#define KT_IDLE 	-1 		// not pending: new, firing, or gone
+#define KT_EXPIRED 	-2 		// on base->expired, callback yet to run
+
+#define WHEEL_BITS 		6
+#define WHEEL_SIZE 		(1 << WHEEL_BITS) 	// slots per level
+#define WHEEL_MASK 		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 	4 	// 2^24 ticks, ~46 hours
+#define WHEEL_MAX_DELTA ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer_base {
+	struct spinlock lock; 			// protects everything below
+	int cpu; 
+	struct ktimer **heap; 			// heap[0..heap_n) 
+	int heap_n, heap_size; 
+	unsigned long nr_irqs; 			// # of vtimer irqs
+	unsigned long nr_saved; 		// # of irqs saved by coalescing
+	struct list_head expired; 		// ktimers to run in the softirq
+	struct list_head wexpired; 		// ditto, wtimers
+	// the timing wheel, cf below
+	struct list_head wheel[WHEEL_LEVELS * WHEEL_SIZE]; 
+	unsigned long wheel_map[WHEEL_LEVELS]; 	// non-empty slots, per level
+	unsigned long wheel_clk; 		// the next tick to process
+	unsigned long wheel_pending; 	// # of timers on the wheel
+	struct ktimer *wheel_timer; 	// the vtimer driving the wheel. for good
+	long wheel_kt; 					// ... its handle, if armed. -1 if not
+	unsigned long wheel_next; 		// ... armed for this tick
+} __cacheline_aligned; 
 
-// test hw, should fire shortly in the future
-__attribute__((unused))
-static void sys_timer_test() { 
-	unsigned int curVal = get32(TIMER_CLO);
-	curVal += interval;
-	put32(TIMER_C1, curVal);	
+#define HEAP_MIN_SIZE 	64
+static struct timer_base timer_bases[NCPU]; 
+static struct kmem_cache *ktimer_cache; 
+static unsigned ktimer_seq; 
+
+static inline struct timer_base *this_base(void) {
+	return &timer_bases[cpuid()]; 
 }
 
-void sys_timer_init(void)
-{
-	initlock(&timerlock, "timer"); 
-	memzero(timers, sizeof(timers)); 	// all field zeros	
-	// sys_timer_tune_delay(); // can be slow when cache is off 
+// va are 32 bits (cf mmu.h): seq goes to the upper half. never 0, never <0
+static inline long ktimer_handle(struct ktimer *t) {
+	return ((long)t->seq << 32) | (unsigned long)t; 
 }
 
-// we have added/removed a virt timer, now adjust the phys timer accordingly
-// caller must hold timerlock
-// return 0 on success
-static int adjust_sys_timer(void)
-{
-	unsigned long next = (unsigned long)-1; // upcoming firing time, to be determined
+static inline struct ktimer *handle_to_ktimer(long h) {
+	return (struct ktimer *)(h & 0xffffffffUL); 
+}
+
+static inline int ktimer_pending(struct ktimer *t, long h) {
+	return t->seq == (unsigned long)h >> 32 && t->idx != KT_IDLE; 
+}
+
+static inline void heap_set(struct timer_base *b, int i, struct ktimer *t) {
+	b->heap[i] = t; 
+	t->idx = i; 
+}
 
-	for (int tt = 0; tt < N_TIMERS; tt++) {
-		if (!timers[tt].handler)
+static void sift_up(struct timer_base *b, int i) {
+	struct ktimer *t = b->heap[i]; 
+	int parent; 
+
+	while (i > 0) {
+		parent = (i - 1) / 2; 
+		if (b->heap[parent]->latest <= t->latest)
+			break; 
+		heap_set(b, i, b->heap[parent]); 
+		i = parent; 
+	}
+	heap_set(b, i, t); 
+}
+
+static void sift_down(struct timer_base *b, int i) {
+	struct ktimer *t = b->heap[i]; 
+	int child; 
+
+	while ((child = 2 * i + 1) < b->heap_n) {
+		if (child + 1 < b->heap_n 
+			&& b->heap[child + 1]->latest < b->heap[child]->latest)
+			child++; 
+		if (t->latest <= b->heap[child]->latest)
+			break; 
+		heap_set(b, i, b->heap[child]); 
+		i = child; 
+	}
+	heap_set(b, i, t); 
+}
+
+/* caller holds b->lock. return 0 on success, -1 if the heap is full: it 
+only grows w/o the lock, cf lock_this_base() */
+static int heap_insert(struct timer_base *b, struct ktimer *t) {
+	if (b->heap_n == b->heap_size)
+		return -1; 
+	t->base = b; 
+	heap_set(b, b->heap_n++, t); 
+	sift_up(b, t->idx); 
+	return 0; 
+}
+
+/* caller holds b->lock */
+static void heap_remove(struct timer_base *b, struct ktimer *t) {
+	int i = t->idx; 
+
+	BUG_ON(i < 0 || i >= b->heap_n || b->heap[i] != t); 
+	t->idx = KT_IDLE; 
+	if (i == --b->heap_n)
+		return; 
+	heap_set(b, i, b->heap[b->heap_n]); 	// the last one fills the hole
+	if (i > 0 && b->heap[(i - 1) / 2]->latest > b->heap[i]->latest)
+		sift_up(b, i); 
+	else
+		sift_down(b, i); 
+}
+
+/* lock this cpu's base, w/ room on its heap for a new ktimer, besides the
+slot kept for the wheel's (cf wheel_arm()). return the
+base, locked & push_off()'d. The heap grows w/o the lock, w/ irq as the
+caller has it: at 10k timers, that is an 80KB kmalloc & copy. So it is 
+allocated first, then the lock retaken and the size rechecked. Out of 
+memory, the base is returned full: heap_insert() fails */
+static struct timer_base *lock_this_base(void) {
+	struct timer_base *b; 
+	struct ktimer **h, **old; 
+	int size, nomem = 0; 
+
+	for (;;) {
+		push_off(); 	// stay on this cpu, whose base we use
+		b = this_base(); 
+		acquire(&b->lock); 
+		if (b->heap_n + 1 < b->heap_size || nomem)
+			return b; 
+		size = b->heap_size; 
+		release(&b->lock); 
+		pop_off(); 
+
+		if (!(h = kmalloc(2 * size * sizeof(*h)))) {
+			nomem = 1; 
 			continue; 
-		if (timers[tt].elapseat < next) {
-			if (timers[tt].elapseat < current_counter()) {
-				/* timer expired, but handler not called? this could happen on
-				qemu when cpu is slow. call the handler here */
-				(*timers[tt].handler)(tt, timers[tt].param, timers[tt].context);
-				timers[tt].handler = 0; 
-			} else 
-				/* give "next" a bit slack so current_counter() won't exceed
-				"next" before we retuen from this function */
-				next = timers[tt].elapseat + 10*1000 /*10ms*/;
 		}
+		acquire(&b->lock); 
+		if (b->heap_size == size) { 	// nobody resized it meanwhile
+			memcpy(h, b->heap, b->heap_n * sizeof(*h)); 
+			old = b->heap; 
+			b->heap = h; 
+			b->heap_size *= 2; 
+			h = old; 
+		}
+		release(&b->lock); 
+		kfree(h); 
 	}
+}
 
-	// a known bug (TBD. may occur: when qemu is very slow, or on actual hw
-	// timer expired, but handler not called?? should we handle it?
-	BUG_ON(current_counter() > next); 
+/* halve @b's heap once it is under a quarter full, so that a burst of 
+timers does not pin the memory for good. w/o the lock, as above. called
+w/o b->lock */
+static void heap_shrink(struct timer_base *b) {
+	struct ktimer **h, **old; 
+	int size = __atomic_load_n(&b->heap_size, __ATOMIC_RELAXED); 
 
-	// if no valid handlers, we leave TIMER_C1 as is. it will trigger a timer
-	// irq when wrapping around (~4000 sec later). this is fine as our isr
-	// compares 64bit counters. 
-	if (next == 0xFFFFFFFFFFFFFFFF) 
-		return 0; 
+	if (size <= HEAP_MIN_SIZE 
+			|| __atomic_load_n(&b->heap_n, __ATOMIC_RELAXED) >= size / 4)
+		return; 
+	if (!(h = kmalloc(size / 2 * sizeof(*h)))) 
+		return; 	// keep the big one 
+	acquire(&b->lock); 
+	if (b->heap_size == size && b->heap_n < size / 4) { 	// recheck
+		memcpy(h, b->heap, b->heap_n * sizeof(*h)); 
+		old = b->heap; 
+		b->heap = h; 
+		b->heap_size = size / 2; 
+		h = old; 
+	}
+	release(&b->lock); 
+	kfree(h); 
+}
 
-	// the compare reg is only 32 bits so we have to ignore the high 32 bits of
-	// the counter. this is ok even if the low 32 bits have to wrap around 
-	// in order to match TIMER_C1 (cf the isr)	
-	put32(TIMER_C1, (unsigned)next);  
+static void ktimer_ctor(void *obj) {
+	struct ktimer *t = obj; 
+	t->handler = 0; 
+	t->seq = 0; 
+	t->idx = KT_IDLE; 
+	t->base = 0; 
+}
 
-	return 0; 
+static void ktimer_free(struct ktimer *t) {
+	t->handler = 0; 
+	t->seq = 0; 	// stale handles no longer match
+	kmem_cache_free(ktimer_cache, t); 
 }
 
-// return: timer id (>=0, <N_TIMERS) allocated. -1 on error
-// the clock counter has 64bit, so we assume it won't wrap around
-// in the current impl. 
-// "handler": callback, to be called in irq context
-// NB: caller must hold & then release timerlock
-static int ktimer_start_nolock(unsigned delayms, TKernelTimerHandler *handler, 
-		void *para, void *context) {
-	unsigned t; 
-	unsigned long cur; 
+static void wheel_init(struct timer_base *b); 
 
-	for (t = 0; t < N_TIMERS; t++) {
-		if (timers[t].handler == 0) 
-			break; 
+void sys_timer_init(void)
+{
+	struct timer_base *b; 
+
+	ktime_init(); 
+
+	ktimer_cache = kmem_cache_create("ktimer", sizeof(struct ktimer), 0, 
+		ktimer_ctor, SLAB_TYPESAFE); 
+	BUG_ON(!ktimer_cache); 
+	for (int i = 0; i < NCPU; i++) {
+		b = &timer_bases[i]; 
+		initlock(&b->lock, "timer"); 
+		b->cpu = i; 
+		b->heap = kmalloc(HEAP_MIN_SIZE * sizeof(*b->heap)); 
+		BUG_ON(!b->heap); 
+		b->heap_size = HEAP_MIN_SIZE; 
+		b->heap_n = 0; 
+		INIT_LIST_HEAD(&b->expired); 
+		INIT_LIST_HEAD(&b->wexpired); 
+		wheel_init(b); 
+	}
+}
+
+/* per core: CNTV off until a vtimer is queued. irq routed to this core */
+void generic_vtimer_init(void) {
+	asm volatile("msr cntv_ctl_el0, %0" :: "r" (0UL)); 
+}
+
+// we have added/removed a virt timer, now adjust this cpu's CNTV accordingly
+// caller must hold b->lock
+static void adjust_vtimer(struct timer_base *b)
+{
+	// another cpu's: it will find out at its next vtimer irq
+	if (b != this_base())
+		return; 
+	if (b->heap_n == 0) {	// nothing pending: off 
+		asm volatile("msr cntv_ctl_el0, %0; isb" :: "r" (0UL)); 
+		return; 
 	}
-	if (t == N_TIMERS) {
-		E("ktimer_start failed. # max timer reached"); 
+	asm volatile("msr cntv_cval_el0, %0" :: "r" (b->heap[0]->latest)); 
+	asm volatile("msr cntv_ctl_el0, %0; isb" :: "r" (1UL)); 	// enabled, unmasked
+}
+
+/* queue @t, not pending, w/ a fresh handle. caller holds b->lock and 
+has made room on the heap. return the handle */
+static long ktimer_queue(struct timer_base *b, struct ktimer *t, 
+		unsigned long elapseat, unsigned long slack) {
+	unsigned seq; 
+
+	t->elapseat = elapseat; 
+	t->latest = elapseat + slack; 
+	while (!(seq = __atomic_add_fetch(&ktimer_seq, 1, __ATOMIC_RELAXED) 
+			& 0x7fffffff))
+		; 
+	t->seq = seq; 
+	BUG_ON(heap_insert(b, t)); 
+	adjust_vtimer(b); 
+	return ktimer_handle(t); 
+}
+
+// return: timer handle (>0). -1 on error
+// "elapseat": absolute, in generic counter ticks. "slack": ditto, how 
+// late it may fire, to be coalesced w/ others
+// "handler": callback, to be called in the timer softirq (cf above), on
+// the cpu that starts the timer 
+// NB: caller must hold & then release b->lock of this cpu's base
+static long ktimer_start_at_nolock(struct timer_base *b, unsigned long elapseat, 
+		unsigned long slack, TKernelTimerHandler *handler, void *para, 
+		void *context) {
+	struct ktimer *t; 
+
+	// the last slot is the wheel's. full: lock_this_base() is out of memory
+	if (b->heap_n + 1 >= b->heap_size 
+			|| !(t = kmem_cache_alloc(ktimer_cache))) {
+		E("ktimer_start failed. out of memory"); 
 		return -1; 
 	}
 
-	cur = current_counter(); 
-	BUG_ON(cur + TICKPERMS * delayms < cur); // 64bit counter wraps around??
+	t->handler = handler; 
+	t->param = para; 
+	t->context = context; 
+	return ktimer_queue(b, t, elapseat, slack); 
+}
 
-	timers[t].handler = handler; 
-	timers[t].param = para; 
-	timers[t].context = context; 
-	timers[t].elapseat = cur + TICKPERMS * delayms; 
+/* fire in [@delayms, @delayms + @slackms] from now, whenever it can share
+an irq w/ other timers. cf above */
+long ktimer_start_range(unsigned delayms, unsigned slackms, 
+		TKernelTimerHandler *handler, void *para, void *context) {
+	struct timer_base *b = lock_this_base(); 
+	long ret;
 
-	adjust_sys_timer(); 
-	return t; 
+	ret = ktimer_start_at_nolock(b, arch_counter() + cnt_per_ms * delayms, 
+		cnt_per_ms * slackms, handler, para, context); 
+	release(&b->lock); 
+	pop_off(); 
+	return ret;
 }
 
-int ktimer_start(unsigned delayms, TKernelTimerHandler *handler, 
+long ktimer_start(unsigned delayms, TKernelTimerHandler *handler, 
 		void *para, void *context) {
-	int ret;
-	acquire(&timerlock); 
-	ret = ktimer_start_nolock(delayms, handler, para, context); 
-	release(&timerlock); 
-	return ret;
+	return ktimer_start_range(delayms, 0, handler, para, context); 
 }
 
-// return 0 on okay, -1 if no such timer/handler, 
-//	-2 if already fired (will clean anyway)
-int ktimer_cancel(int t) {
-	unsigned long cur; 
+/* # of vtimer irqs, and of irqs saved by coalescing, on all cpus so far */
+void ktimer_stats(unsigned long *irqs, unsigned long *saved) {
+	*irqs = *saved = 0; 
+	for (int i = 0; i < NCPU; i++) {
+		*irqs += timer_bases[i].nr_irqs; 
+		*saved += timer_bases[i].nr_saved; 
+	}
+}
 
-	if (t < 0 || t >= N_TIMERS)
+/* cf ktimer_cancel(). caller holds b->lock, @b being @t's base */
+static int ktimer_cancel_nolock(struct timer_base *b, struct ktimer *t, long h) {
+	int ret = 0; 
+
+	// gone: fired or cancelled, the object maybe reused by another timer
+	if (!ktimer_pending(t, h) || t->base != b)
 		return -1; 
 
-	cur = current_counter();
-	acquire(&timerlock); 
+	if (t->idx == KT_EXPIRED) { 	// callback yet to run: it won't
+		list_del(&t->entry); 
+		t->idx = KT_IDLE; 
+		ret = -2; 
+	} else {
+		if (t->elapseat < arch_counter()) // expired, irq yet to come
+			ret = -2; 
+		heap_remove(b, t); 
+	}
+	ktimer_free(t); 
+	adjust_vtimer(b); 	
+	return ret; 
+}
+
+// return 0 on okay, -1 if no such timer/handler (e.g. already fired), 
+//	-2 if expired but not fired yet (will clean anyway)
+int ktimer_cancel(long h) {
+	struct ktimer *t = handle_to_ktimer(h); 
+	struct timer_base *b; 
+	int ret; 
 
-	if (!timers[t].handler) {	// invalid handler
-		release(&timerlock); 
+	if (h <= 0 || !t)
 		return -1; 
-	}
 
-	if (timers[t].elapseat < cur) { // already fired? 
-		timers[t].handler = 0; 
-		timers[t].context = 0; 
-		timers[t].param = 0; 
-		release(&timerlock); 
-		return -2; 
-	}
+	b = t->base; 	// may be stale: checked under the lock
+	if (!b)
+		return -1; 
+	acquire(&b->lock); 
+	ret = ktimer_cancel_nolock(b, t, h); 
+	release(&b->lock);
+	heap_shrink(b); 
+	return ret;  
+}
+
+static void wheel_run_expired(struct timer_base *b); 
 
-	timers[t].handler = 0; 
+/* run the callbacks of expired timers, w/ irq on. called w/ irq off, at 
+the end of the vtimer irq; returns w/ irq off */
+static void timer_softirq(struct timer_base *b) {
+	struct cpu *c = mycpu(); 
+	struct ktimer *t; 
+	long h; 
 
-	adjust_sys_timer(); 	
-	release(&timerlock);
+	if (c->in_softirq) 	// nested in a softirq: it will pick up ours 
+		return; 
+	c->in_softirq = 1; 
+	for (;;) {
+		acquire(&b->lock); 	// irq off: nothing can be queued unseen 
+		if (list_empty(&b->expired)) {
+			release(&b->lock); 
+			break; 
+		}
+		t = list_first_entry(&b->expired, struct ktimer, entry); 
+		list_del(&t->entry); 
+		t->idx = KT_IDLE; 	// firing: no longer cancellable
+		h = ktimer_handle(t); 
+		release(&b->lock); 
 
-	return 0;  
+		enable_irq(); 
+		(*t->handler)(h, t->param, t->context); 
+		if (t != b->wheel_timer) 	// the wheel's is for good, cf wheel_arm()
+			ktimer_free(t); 
+		heap_shrink(b); 
+		disable_irq(); 
+	}
+	c->in_softirq = 0; 
 }
 
-// the irq handler for sys_timer
+// the irq handler for this cpu's CNTV 
 // called by irq.c 
-void sys_timer_irq(void) 
+void generic_vtimer_irq(void) 
 {
+	struct timer_base *b = this_base(); 
+	struct ktimer *t; 
+	unsigned long cur; 
+
 	V("called");	
 
-	// timer1 must have pending match. below could happen under high load. why?
-	BUG_ON(!(get32(TIMER_CS) & TIMER_CS_M1));  
-	put32(TIMER_CS, TIMER_CS_M1);	// clear timer1 match
+	acquire(&b->lock); 
+	b->nr_irqs++; 
+	cur = arch_counter(); 
+	// expired ones are all at the top, w/ those whose windows are open
+	while (b->heap_n > 0 && (t = b->heap[0])->elapseat <= cur) { // should fire  
+		V("expired, h %lx", (unsigned long)t->handler);	
+		if (t->latest > cur) 	// would have needed its own irq 
+			b->nr_saved++; 
+		heap_remove(b, t); 
+		t->idx = KT_EXPIRED; 
+		list_add_tail(&t->entry, &b->expired); 
+	}
+	adjust_vtimer(b); 	// also deasserts the irq: new cval in the future, or off
+	release(&b->lock);
+
+	timer_softirq(b); 
+}
 
-	unsigned long cur = current_counter(); 
+//////////////////////////////
+// timing wheel: coarse timeouts 
 
-	acquire(&timerlock); 
-	for (int t = 0; t < N_TIMERS; t++) {
-		TKernelTimerHandler *h = timers[t].handler; 
-		if (h == 0) 
-			continue; 
-		if (timers[t].elapseat <= cur) { // should fire  
-			V("called, id %d h %lx", t, (unsigned long)timers[t].handler);	
-			timers[t].handler = 0; 
-			(*h)(t, timers[t].param, timers[t].context); 			
-		}		
+/* Most timeouts (sleep_timeout(), I/O retries, watchdogs) are coarse and
+are cancelled well before they expire. For them, the heap's O(log n) and a
+slab object per timer are overkill. A hierarchical timing wheel (after 
+linux's classic timer wheel) makes start & cancel O(1): a list add/del 
+and a bit in a bitmap, on a struct wtimer embedded in the caller.
+
+Time is in wheel ticks of WHEEL_TICK_MS. Level 0 has a slot per tick for 
+the next WHEEL_SIZE ticks; each higher level has slots WHEEL_SIZE times as
+wide. A timer goes to the finest level that covers its expiry; whenever 
+level 0 wraps around, the current slot of the next level up is cascaded 
+(re-inserted) into finer levels. So a timer moves at most WHEEL_LEVELS-1 
+times in its life, and most are cancelled before they move at all.
+
+The wheel is driven by a single precise vtimer (cf above), armed only 
+for the next tick that has work: the next non-empty level 0 slot, or the
+next cascade. No pending wtimers, no interrupts. Expiry is rounded up to 
+a tick. Per cpu, in the timer base, protected by its lock */
+
+static inline unsigned long wheel_now(void) {
+	return arch_counter() / (cnt_per_ms * WHEEL_TICK_MS); 
+}
+
+static void wheel_timer_handler(TKernelTimerHandle h, void *param, void *context); 
+
+static void wheel_init(struct timer_base *b) {
+	for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&b->wheel[i]); 
+	b->wheel_timer = kmem_cache_alloc(ktimer_cache); 
+	BUG_ON(!b->wheel_timer); 
+	b->wheel_timer->handler = wheel_timer_handler; 
+	b->wheel_timer->param = b; 
+	b->wheel_timer->context = 0; 
+	b->wheel_kt = -1; 
+}
+
+/* caller holds b->lock */
+static void wheel_add(struct timer_base *b, struct wtimer *t) {
+	unsigned long delta, expires = t->expires; 
+	int level; 
+
+	if ((long)(expires - b->wheel_clk) < 0)		// due: the next tick
+		expires = b->wheel_clk; 
+	delta = expires - b->wheel_clk; 
+	if (delta > WHEEL_MAX_DELTA)
+		expires = b->wheel_clk + (delta = WHEEL_MAX_DELTA); 
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (1UL << (WHEEL_BITS * (level + 1))))
+			break; 
+	t->slot = level * WHEEL_SIZE 
+		+ ((expires >> (WHEEL_BITS * level)) & WHEEL_MASK); 
+	t->base = b; 
+	list_add_tail(&t->entry, &b->wheel[t->slot]); 
+	b->wheel_map[level] |= 1UL << (t->slot & WHEEL_MASK); 
+}
+
+/* caller holds b->lock */
+static void wheel_del(struct timer_base *b, struct wtimer *t) {
+	int slot = t->slot; 
+
+	list_del(&t->entry); 
+	if (list_empty(&b->wheel[slot]))
+		b->wheel_map[slot / WHEEL_SIZE] &= ~(1UL << (slot & WHEEL_MASK)); 
+	t->slot = -1; 
+}
+
+/* move the timers of @slot to their new slots */
+static void wheel_cascade(struct timer_base *b, int slot) {
+	struct list_head *l, *n, tmp; 
+
+	INIT_LIST_HEAD(&tmp); 
+	list_for_each_safe(l, n, &b->wheel[slot]) {
+		list_del(l); 
+		list_add_tail(l, &tmp); 
+	}
+	b->wheel_map[slot / WHEEL_SIZE] &= ~(1UL << (slot & WHEEL_MASK)); 
+	list_for_each_safe(l, n, &tmp) {
+		list_del(l); 
+		wheel_add(b, list_entry(l, struct wtimer, entry)); 
+	}
+}
+
+/* the next tick that has work, cf above. caller holds b->lock */
+static unsigned long wheel_next_tick(struct timer_base *b) {
+	unsigned idx = b->wheel_clk & WHEEL_MASK; 
+	unsigned long wrap = (b->wheel_clk + WHEEL_MASK) & ~(unsigned long)WHEEL_MASK; 
+	unsigned long map = b->wheel_map[0] >> idx; 	// slots from now to the wrap
+	unsigned long next = (unsigned long)-1; 
+
+	if (map)
+		next = b->wheel_clk + __builtin_ctzl(map); 
+	else if (b->wheel_map[0]) 		// level 0 slots past the wrap
+		next = wrap; 
+	for (int l = 1; l < WHEEL_LEVELS; l++)
+		if (b->wheel_map[l] && wrap < next) 	// cascade first
+			next = wrap; 
+	return next; 
+}
+
+/* make sure the wheel's vtimer fires by the next tick with work. It is 
+allocated once (cf wheel_init()) and re-queued, and the heap always keeps
+a slot for it (cf lock_this_base()): arming never fails, or a wtimer 
+might never fire. caller holds b->lock, on b's cpu */
+static void wheel_arm(struct timer_base *b) {
+	unsigned long next = wheel_next_tick(b), now = wheel_now(); 
+	struct ktimer *kt = b->wheel_timer; 
+
+	if (next == (unsigned long)-1)
+		return; 
+	/* the wheel may lag behind (it sleeps till there is work): catch up at
+	the next tick */
+	if (next <= now)
+		next = now + 1; 
+	if (b->wheel_kt > 0 && b->wheel_next <= next)
+		return; 
+	if (kt->idx >= 0) 
+		heap_remove(b, kt); 
+	else if (kt->idx == KT_EXPIRED) { 	// its callback yet to run: it won't
+		list_del(&kt->entry); 
+		kt->idx = KT_IDLE; 
+	}
+	b->wheel_next = next; 
+	b->wheel_kt = ktimer_queue(b, kt, next * cnt_per_ms * WHEEL_TICK_MS, 0); 
+}
+
+/* runs as a vtimer callback (in the softirq). process every tick up to
+now; call the expired timers' callbacks */
+static void wheel_timer_handler(TKernelTimerHandle h, void *param, void *context) {
+	struct timer_base *b = param; 
+	unsigned long now = wheel_now(); 
+	struct list_head *l, *n; 
+	struct wtimer *t; 
+	unsigned idx; 
+
+	acquire(&b->lock); 
+	if (h != b->wheel_kt) {
+		release(&b->lock); 
+		return; 
+	}
+	b->wheel_kt = -1; 
+	while ((long)(b->wheel_clk - now) <= 0 && b->wheel_pending) {
+		idx = b->wheel_clk & WHEEL_MASK; 
+		// level 0 wraps: cascade the next level's current slot, and so on up 
+		for (int l = 1; l < WHEEL_LEVELS && idx == 0; l++) {
+			idx = (b->wheel_clk >> (WHEEL_BITS * l)) & WHEEL_MASK; 
+			wheel_cascade(b, l * WHEEL_SIZE + idx); 
+		}
+		idx = b->wheel_clk & WHEEL_MASK; 
+		list_for_each_safe(l, n, &b->wheel[idx]) {
+			t = list_entry(l, struct wtimer, entry); 
+			wheel_del(b, t); 
+			t->slot = WT_EXPIRED; 
+			list_add_tail(&t->entry, &b->wexpired); 
+			b->wheel_pending--; 
+		}
+		b->wheel_clk++; 
+	}
+	if (!b->wheel_pending)
+		b->wheel_clk = now + 1; 	// idle: jump ahead
+	wheel_arm(b); 
+	release(&b->lock); 
+
+	wheel_run_expired(b); 
+}
+
+/* call back the expired wtimers, one at a time w/o the lock: a callback 
+may restart its own timer, or start/cancel others */
+static void wheel_run_expired(struct timer_base *b) {
+	struct wtimer *t; 
+
+	for (;;) {
+		acquire(&b->lock); 
+		if (list_empty(&b->wexpired)) {
+			release(&b->lock); 
+			break; 
+		}
+		t = list_first_entry(&b->wexpired, struct wtimer, entry); 
+		list_del(&t->entry); 
+		t->slot = -1; 
+		release(&b->lock); 
+		t->fn(t); 
 	}
-	adjust_sys_timer(); 
-	release(&timerlock);
+}
+
+void wtimer_init(struct wtimer *t, void (*fn)(struct wtimer *), void *data) {
+	t->fn = fn; 
+	t->data = data; 
+	t->slot = -1; 
+	t->base = 0; 
+	t->entry.next = t->entry.prev = 0; 
+}
+
+/* caller holds b->lock */
+static void __wtimer_start(struct timer_base *b, struct wtimer *t, unsigned ms) {
+	if (!b->wheel_pending)
+		b->wheel_clk = wheel_now() + 1; 
+	t->expires = wheel_now() + (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS + 1; 
+	wheel_add(b, t); 
+	b->wheel_pending++; 
+	wheel_arm(b); 
+}
+
+/* (re)start @t to expire in @ms (rounded up to wheel ticks), on this cpu. 
+O(1), unless @t is the earliest on the wheel */
+void wtimer_start(struct wtimer *t, unsigned ms) {
+	struct timer_base *b; 
+
+	wtimer_cancel(t); 	// if pending, maybe on another cpu's wheel
+	push_off(); 
+	b = this_base(); 
+	acquire(&b->lock); 
+	__wtimer_start(b, t, ms); 
+	release(&b->lock); 
+	pop_off(); 
+}
+
+/* return 0 if cancelled, -1 if not pending (fired or never started). 
+O(1): the wheel's vtimer, if armed for @t, stays armed and finds nothing */
+int wtimer_cancel(struct wtimer *t) {
+	struct timer_base *b = t->base; 
+	int ret = -1; 
+
+	if (!b)
+		return -1; 
+	acquire(&b->lock); 
+	if (t->base != b)
+		; 	// restarted on another cpu meanwhile. not ours
+	else if (t->slot >= 0) {
+		wheel_del(b, t); 
+		b->wheel_pending--; 
+		ret = 0; 
+	} else if (t->slot == WT_EXPIRED) { 	// callback yet to run: it won't
+		list_del(&t->entry); 
+		t->slot = -1; 
+		ret = 0; 
+	}
+	release(&b->lock); 
+	return ret; 
 }
 #endif 
+
+//////////////////////////////
+// periodic timers 
+
+/* Re-arming a one-shot timer from its callback, relative to "now", makes a
+periodic timer drift: every period is stretched by the callback's latency.
+A ptimer instead keeps absolute deadlines, in us since boot on the generic
+counter, and computes each next deadline from the previous one. So a 60Hz
+renderer or a 1kHz sampler stays locked to wall time; latency only delays
+individual callbacks, and never accumulates. 
+
+A ptimer may be given slack (cf ptimer_set_slack()), to share irqs w/
+other timers (cf above). It is not carried over: the next deadline is 
+still computed from the previous one. 
+
+Optionally, deadlines are phase aligned: at multiples of the period (plus
+a phase) on the clock, so that timers of related periods tick together.
+
+If callbacks fall behind by whole periods (e.g. irqs masked for long), the
+missed deadlines are skipped rather than fired back to back: the callback
+is told how many were missed, and the total is kept in t->overruns. 
+
+A ptimer rides on a vtimer (cf above) for its next deadline, re-armed 
+before the callback runs. Per cpu, in the timer base; its lock protects
+the ptimer's state */
+
+static void ptimer_handler(TKernelTimerHandle h, void *param, void *context); 
+
+/* arm @t's vtimer for t->expires. caller holds b->lock, on b's cpu */
+static int ptimer_arm(struct timer_base *b, struct ptimer *t) {
+	t->kt = ktimer_start_at_nolock(b, us_to_cnt(t->expires), 
+		us_to_cnt(t->slack), ptimer_handler, t, 0); 
+	return t->kt > 0 ? 0 : -1; 
+}
+
+static void ptimer_handler(TKernelTimerHandle h, void *param, void *context) {
+	struct ptimer *t = param; 
+	struct timer_base *b = lock_this_base(); 	// room to re-arm
+	unsigned long now, missed = 0; 
+
+	if (t->base != b || h != t->kt) { 	// cancelled, or restarted meanwhile 
+		release(&b->lock); 
+		pop_off(); 
+		return; 
+	}
+	now = ktime_get_us(); 
+	if (now >= t->expires + t->period) { 	// behind: skip whole periods
+		missed = (now - t->expires) / t->period; 
+		t->overruns += missed; 
+	}
+	t->expires += (missed + 1) * t->period; 	// from the deadline, not now
+	t->fires++; 
+	if (ptimer_arm(b, t)) {
+		E("ptimer stopped. out of memory"); 
+		t->kt = -1; 
+	}
+	release(&b->lock); 
+	pop_off(); 
+
+	t->fn(t, missed); 
+}
+
+void ptimer_init(struct ptimer *t, void (*fn)(struct ptimer *, unsigned long), 
+		void *data) {
+	t->fn = fn; 
+	t->data = data; 
+	t->kt = -1; 
+	t->base = 0; 
+	t->period = t->expires = t->slack = 0; 
+	t->fires = t->overruns = 0; 
+}
+
+/* (re)start @t to fire every @period_us, on this cpu. @phase_us: 
+PTIMER_UNALIGNED, the 1st deadline is one period from now; otherwise, 
+deadlines are at k * @period_us + @phase_us (us since boot), the 1st one 
+being the next such instant. return 0 on success, -1 on error */
+int ptimer_start(struct ptimer *t, unsigned long period_us, long phase_us) {
+	struct timer_base *b; 
+	unsigned long now; 
+	int ret; 
+
+	if (!period_us || (phase_us != PTIMER_UNALIGNED 
+			&& (phase_us < 0 || (unsigned long)phase_us >= period_us)))
+		return -1; 
+
+	ptimer_cancel(t); 	// if pending, maybe on another cpu 
+	b = lock_this_base(); 
+	now = ktime_get_us(); 
+	t->base = b; 
+	t->period = period_us; 
+	if (phase_us == PTIMER_UNALIGNED)
+		t->expires = now + period_us; 
+	else if (now < (unsigned long)phase_us)
+		t->expires = phase_us; 
+	else
+		t->expires = (now - phase_us) / period_us * period_us 
+			+ period_us + phase_us; 
+	t->fires = t->overruns = 0; 
+	ret = ptimer_arm(b, t); 
+	release(&b->lock); 
+	pop_off(); 
+	return ret; 
+}
+
+/* let @t fire up to @slack_us late, to be coalesced. from the next deadline 
+on. e.g. stats sampling need not be precise */
+void ptimer_set_slack(struct ptimer *t, unsigned long slack_us) {
+	t->slack = slack_us; 
+}
+
+/* return 0 if stopped, -1 if not running. the callback may still be 
+running, if called from irq context */
+int ptimer_cancel(struct ptimer *t) {
+	struct timer_base *b = t->base; 
+	int ret = -1; 
+
+	if (!b)
+		return -1; 
+	acquire(&b->lock); 
+	if (t->base == b && t->kt > 0) {
+		ktimer_cancel_nolock(b, handle_to_ktimer(t->kt), t->kt); 
+		t->kt = -1; 
+		ret = 0; 
+	}
+	release(&b->lock); 
+	heap_shrink(b); 
+	return ret; 
+}
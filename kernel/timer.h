@@ -0,0 +1,49 @@
+// Kernel timers: the timing wheel for coarse timeouts. cf timer.c
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "list.h"
+
+struct timer_base; 
+
+/* a wheel timer. embedded in its user (no allocation), e.g. on the stack
+of a task that sleeps w/ a timeout. cf wtimer_start() */
+struct wtimer {
+  struct list_head entry;       // on a wheel slot, when pending
+  unsigned long expires;        // in wheel ticks (WHEEL_TICK_MS)
+  int slot;                     // level * WHEEL_SIZE + index. -1: not pending
+  void (*fn)(struct wtimer *t); // called once expired, in the timer softirq
+  void *data;                   // for @fn
+  struct timer_base *base;      // the cpu's wheel it was last started on
+};
+
+#define WT_EXPIRED  -2            // wtimer::slot: callback yet to run
+
+void wtimer_init(struct wtimer *t, void (*fn)(struct wtimer *), void *data); 
+void wtimer_start(struct wtimer *t, unsigned ms); 
+int wtimer_cancel(struct wtimer *t); 
+
+/* a periodic timer, w/ absolute deadlines: no drift. embedded in its user.
+cf ptimer_start() */
+struct ptimer {
+  unsigned long period;         // us
+  unsigned long expires;        // the next deadline, cf ktime_get_us()
+  unsigned long fires;          // # of callbacks since started
+  unsigned long overruns;       // # of deadlines missed (skipped) since started
+  unsigned long slack;          // us. may fire this late, cf ptimer_set_slack()
+  void (*fn)(struct ptimer *t, unsigned long missed); // in the timer softirq
+  void *data;                   // for @fn
+  long kt;                      // the vtimer for @expires. -1: not running
+  struct timer_base *base;      // the cpu's it was last started on
+};
+
+#define PTIMER_UNALIGNED  -1L
+
+void ptimer_init(struct ptimer *t, void (*fn)(struct ptimer *, unsigned long), 
+    void *data); 
+int ptimer_start(struct ptimer *t, unsigned long period_us, long phase_us); 
+int ptimer_cancel(struct ptimer *t); 
+void ptimer_set_slack(struct ptimer *t, unsigned long slack_us); 
+
+#endif
@@ -2,14 +2,25 @@
 #include "utils.h"
 #include "debug.h"
 #include "sched.h"
+#include "sync.h"
+#include "ring.h"
+#include "msgchan.h"
+#include "slab.h"
+#include "mmu.h"
+#include "timer.h"
 
 static void handler(TKernelTimerHandle hTimer, void *param, void *context) {
 	unsigned sec, msec; 
 	current_time(&sec, &msec);
-	I("%u.%03u: fired. on cpu %d. htimer %ld, param %lx, contex %lx", sec, msec,
+	I("%u.%03u: fired. on cpu %d. htimer %lx, param %lx, contex %lx", sec, msec,
 		cpuid(), hTimer, (unsigned long)param, (unsigned long)context); 
 }
 
+static volatile int kt_fired; 
+static void count_handler(TKernelTimerHandle hTimer, void *param, void *context) {
+	kt_fired++; 
+}
+
 // to be called in a kernel process
 void test_ktimer() {
 	unsigned sec, msec; 
@@ -21,28 +32,299 @@ void test_ktimer() {
 	I("%u.%03u ended delaying 500ms", sec, msec); 
 
 	// start, fire 
-	int t = ktimer_start(500, handler, (void *)0xdeadbeef, (void*)0xdeaddeed);
-	I("timer start. timer id %u", t); 
+	long t = ktimer_start(500, handler, (void *)0xdeadbeef, (void*)0xdeaddeed);
+	I("timer start. timer %lx", t); 
 	ms_delay(1000);
-	I("timer %d should have fired", t); 
+	I("timer %lx should have fired", t); 
 
 	// start two, fire
 	t = ktimer_start(500, handler, (void *)0xdeadbeef, (void*)0xdeaddeed);
-	I("timer start. timer id %u", t); 
+	I("timer start. timer %lx", t); 
 	t = ktimer_start(1000, handler, (void *)0xdeadbeef, (void*)0xdeaddeed);
-	I("timer start. timer id %u", t); 
+	I("timer start. timer %lx", t); 
 	ms_delay(2000); 
 	I("both timers should have fired"); 
 
 	// start, cancel 
 	t = ktimer_start(500, handler, (void *)0xdeadbeef, (void*)0xdeaddeed);
-	I("timer start. timer id %u", t);
+	I("timer start. timer %lx", t);
 	ms_delay(100); 
 	int c = ktimer_cancel(t); 
 	I("timer cancel return val = %d", c);
 	BUG_ON(c < 0);
 
 	I("there shouldn't be more callback"); 
+
+	// many more than the old fixed table (20), cancelled out of order
+	static long ts[1000]; 
+	for (int i = 0; i < 1000; i++) {
+		ts[i] = ktimer_start(5000 + (i * 7919) % 1000, handler, 0, 0); 
+		BUG_ON(ts[i] < 0); 
+	}
+	for (int i = 0; i < 1000; i += 2)
+		BUG_ON(ktimer_cancel(ts[i])); 
+	for (int i = 999; i > 0; i -= 2)
+		BUG_ON(ktimer_cancel(ts[i])); 
+	BUG_ON(ktimer_cancel(ts[0]) != -1); 	// stale handle
+	I("1000 timers started & cancelled"); 
+
+	// 100 timers 2ms apart: w/ 50ms slack, they share far fewer irqs 
+	for (int slack = 0; slack <= 50; slack += 50) {
+		unsigned long irqs0, saved0, irqs1, saved1; 
+		kt_fired = 0; 
+		ktimer_stats(&irqs0, &saved0); 
+		for (int i = 0; i < 100; i++)
+			BUG_ON(ktimer_start_range(100 + 2 * i, slack, count_handler, 
+				0, 0) < 0); 
+		ms_delay(500); 
+		ktimer_stats(&irqs1, &saved1); 
+		BUG_ON(kt_fired != 100); 
+		I("slack %d ms: 100 timers, %lu irqs, %lu saved", slack, 
+			irqs1 - irqs0, saved1 - saved0); 
+		if (slack)
+			BUG_ON(irqs1 - irqs0 > 10); 
+	}
+}
+
+// timing wheel. cf timer.c 
+#define NWTIMERS 	10000
+static struct wtimer wts[NWTIMERS]; 
+static volatile int wt_fired; 
+
+static void wt_handler(struct wtimer *t) {
+	wt_fired++; 
+	if (t->data)	// restart from its own callback, once
+		{t->data = 0; wtimer_start(t, 20);}
+}
+
+void test_wtimer(void) {
+	unsigned long t0, t1; 
+
+	// mostly cancelled before expiry: the common case
+	t0 = current_time_ms(); 
+	for (int r = 0; r < 10; r++) {
+		for (int i = 0; i < NWTIMERS; i++) {
+			wtimer_init(&wts[i], wt_handler, 0); 
+			wtimer_start(&wts[i], 100 + (i * 7919) % 100000); // up to 100s
+		}
+		for (int i = 0; i < NWTIMERS; i++)
+			BUG_ON(wtimer_cancel(&wts[i])); 
+	}
+	t1 = current_time_ms(); 
+	BUG_ON(wt_fired); 
+	I("wtimer: %d start+cancel in %lu ms", 10 * NWTIMERS, t1 - t0); 
+
+	// some expire, across levels; one restarts itself
+	for (int i = 0; i < 100; i++) {
+		wtimer_init(&wts[i], wt_handler, i == 0 ? (void *)1 : 0); 
+		wtimer_start(&wts[i], i * 13); 
+	}
+	ms_delay(2000); 
+	BUG_ON(wt_fired != 101); 
+	BUG_ON(wtimer_cancel(&wts[0]) != -1); 	// fired
+	I("wtimer: ok"); 
+}
+
+// timekeeping on the generic counter. cf timer.c 
+void test_ktime(void) {
+	unsigned long ns0, ns1, us0, us1, last = 0; 
+
+	ns0 = ktime_get_ns(); us0 = ktime_get_us(); 
+	for (int i = 0; i < 100000; i++) {
+		ns1 = ktime_get_ns(); 
+		BUG_ON(ns1 < last); 	// monotonic 
+		last = ns1; 
+	}
+	ns1 = ktime_get_ns(); us1 = ktime_get_us(); 
+	I("ktime_get_ns: %lu ns per call", (ns1 - ns0) / 100000); 
+	BUG_ON(us1 - us0 + 2 < (ns1 - ns0) / 1000 
+		|| us1 - us0 > (ns1 - ns0) / 1000 + 2); 	// same clock 
+
+	us0 = ktime_get_us(); 
+	ms_delay(100); 
+	us1 = ktime_get_us(); 
+	I("ms_delay(100): %lu us", us1 - us0); 
+	BUG_ON(us1 - us0 < 100000 || us1 - us0 > 105000); 
+
+	us0 = ktime_get_us(); 
+	for (int i = 0; i < 1000; i++)
+		ns_delay(500); 
+	us1 = ktime_get_us(); 
+	I("1000x ns_delay(500): %lu us", us1 - us0); 
+}
+
+// periodic timers. cf timer.c 
+static void pt_handler(struct ptimer *t, unsigned long missed) {
+	if (t->data) 	// a slow callback: must not stretch the period 
+		us_delay(300); 
+}
+
+void test_ptimer(void) {
+	static struct ptimer pts[3]; 
+	unsigned long n; 
+
+	ptimer_init(&pts[0], pt_handler, (void *)1); 	// 1kHz sampler 
+	ptimer_init(&pts[1], pt_handler, 0); 			// 60Hz renderer
+	ptimer_init(&pts[2], pt_handler, 0); 			// ditto, aligned 
+	BUG_ON(ptimer_start(&pts[0], 1000, PTIMER_UNALIGNED)); 
+	BUG_ON(ptimer_start(&pts[1], 16667, PTIMER_UNALIGNED)); 
+	BUG_ON(ptimer_start(&pts[2], 16667, 0)); 
+	BUG_ON(ptimer_start(&pts[2], 16667, 16667) != -1); 	// bad phase
+	BUG_ON(pts[2].expires % 16667); 
+	ms_delay(2000); 	// bounded by the counter: callbacks don't stretch it
+	for (int i = 0; i < 3; i++)
+		BUG_ON(ptimer_cancel(&pts[i])); 
+	BUG_ON(ptimer_cancel(&pts[0]) != -1); 
+
+	// over 2 sec, every deadline is either fired or counted as missed
+	n = pts[0].fires + pts[0].overruns; 
+	I("ptimer 1kHz: %lu fires, %lu overruns", pts[0].fires, pts[0].overruns); 
+	BUG_ON(n < 1990 || n > 2001); 
+	n = pts[1].fires + pts[1].overruns; 
+	I("ptimer 60Hz: %lu fires, %lu overruns", pts[1].fires, pts[1].overruns); 
+	BUG_ON(n < 118 || n > 120); 
+	I("ptimer: ok"); 
+}
+
+// timer benchmark & stress: N timers w/ random deadlines. start/cancel cost,
+// and expiry lateness (fired - requested) percentiles, on the generic counter.
+// to measure changes to the timer queue & irq path objectively 
+#define NBENCH 	10000
+static long bench_h[NBENCH]; 
+static unsigned long bench_due[NBENCH]; 	// requested, ns. cf ktime_get_ns()
+static unsigned long bench_late[NBENCH]; 	// ns 
+static volatile int bench_fired; 
+static unsigned bench_seed = 12345; 
+
+static unsigned bench_rand(void) { 	// xorshift32
+	bench_seed ^= bench_seed << 13; 
+	bench_seed ^= bench_seed >> 17; 
+	bench_seed ^= bench_seed << 5; 
+	return bench_seed; 
+}
+
+static void bench_handler(TKernelTimerHandle h, void *param, void *context) {
+	unsigned long i = (unsigned long)param, now = ktime_get_ns(); 
+	bench_late[i] = now > bench_due[i] ? now - bench_due[i] : 0; 
+	bench_fired++; 
+}
+
+static void bench_sort(unsigned long *a, int n) { 	// shellsort 
+	for (int gap = n / 2; gap > 0; gap /= 2)
+		for (int i = gap; i < n; i++) {
+			unsigned long v = a[i]; 
+			int j; 
+			for (j = i; j >= gap && a[j - gap] > v; j -= gap)
+				a[j] = a[j - gap]; 
+			a[j] = v; 
+		}
+}
+
+void test_timer_bench(void) {
+	static const int ns[] = {1, 10, 100, 1000, NBENCH}; 
+	unsigned long t0, t1, t2, irqs0, irqs1, saved; 
+	unsigned delay; 
+
+	for (int k = 0; k < sizeof(ns) / sizeof(ns[0]); k++) {
+		int n = ns[k]; 
+
+		// start & cancel, never fired: deadlines 1..10 sec out 
+		t0 = ktime_get_ns(); 
+		for (int i = 0; i < n; i++)
+			BUG_ON((bench_h[i] = ktimer_start(1000 + bench_rand() % 9000, 
+				bench_handler, (void *)(unsigned long)i, 0)) < 0); 
+		t1 = ktime_get_ns(); 
+		for (int i = 0; i < n; i++) 	// scattered order: 7919 is prime
+			BUG_ON(ktimer_cancel(bench_h[(i * 7919) % n])); 
+		t2 = ktime_get_ns(); 
+
+		// fire: deadlines 1..200 ms out 
+		bench_fired = 0; 
+		ktimer_stats(&irqs0, &saved); 
+		for (int i = 0; i < n; i++) {
+			delay = 1 + bench_rand() % 200; 
+			bench_due[i] = ktime_get_ns() + delay * 1000000UL; 
+			BUG_ON(ktimer_start(delay, bench_handler, 
+				(void *)(unsigned long)i, 0) < 0); 
+		}
+		for (int w = 0; bench_fired < n && w < 500; w++)
+			ms_delay(10); 
+		BUG_ON(bench_fired != n); 
+		ktimer_stats(&irqs1, &saved); 
+		bench_sort(bench_late, n); 
+
+		I("timer bench n %5d: start %lu ns cancel %lu ns; lateness p50 %lu p99 %lu "
+			"max %lu us; %lu irqs", n, (t1 - t0) / n, (t2 - t1) / n, 
+			bench_late[n / 2] / 1000, bench_late[n * 99 / 100] / 1000, 
+			bench_late[n - 1] / 1000, irqs1 - irqs0); 
+	}
+}
+
+// sched tick rate sweep: overhead vs. latency, to pick a rate per deployment.
+// cf set_sched_tick_hz() 
+static volatile unsigned long hog_loops; 
+static volatile int hog_stop; 
+static struct spinlock tick_lock; 
+static volatile unsigned long tick_woken_us; 
+
+static void task_hog(int arg) {
+	while (!hog_stop)
+		hog_loops++; 
+	exit_process(0); 
+}
+
+static void tick_waker(struct ptimer *t, unsigned long missed) {
+	acquire(&tick_lock); 
+	tick_woken_us = ktime_get_us(); 
+	wakeup(&tick_lock); 	// chan 
+	release(&tick_lock); 
+}
+
+void test_sched_tick(void) {
+	static const unsigned rates[] = {10, 100, 250, 1000}; 
+	unsigned long loops, base = 0, lat, lat_sum, lat_max, t0; 
+	unsigned hz0 = sched_tick_hz; 
+	struct ptimer pt; 
+	int pid; 
+
+	initlock(&tick_lock, "tick-test"); 
+	ptimer_init(&pt, tick_waker, 0); 
+	for (int r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		BUG_ON(set_sched_tick_hz(rates[r])); 
+
+		// overhead: two cpu hogs (us & a task) for 1 sec. lost work is ticks
+		// & context switches 
+		hog_loops = 0; hog_stop = 0; 
+		pid = copy_process(PF_KTHREAD, (unsigned long)&task_hog, 0, "hog"); 
+		BUG_ON(pid < 0); 
+		loops = 0; 
+		t0 = ktime_get_us(); 
+		while (ktime_get_us() - t0 < 1000000)
+			loops++; 
+		hog_stop = 1; 
+		loops += hog_loops; 
+		BUG_ON(wait(0) != pid); 
+		if (!base)
+			base = loops; 
+
+		// latency: from a wakeup on an idle cpu till we run 
+		lat_sum = lat_max = 0; 
+		BUG_ON(ptimer_start(&pt, 137 * 1000, PTIMER_UNALIGNED)); 
+		acquire(&tick_lock); 
+		for (int i = 0; i < 8; i++) {
+			sleep(&tick_lock, &tick_lock); 
+			lat = ktime_get_us() - tick_woken_us; 
+			lat_sum += lat; 
+			lat_max = MAX(lat_max, lat); 
+		}
+		release(&tick_lock); 
+		ptimer_cancel(&pt); 
+
+		I("tick %4u Hz: work %3lu%% of %u Hz; wakeup latency avg %lu us max %lu us", 
+			rates[r], loops * 100 / base, rates[0], lat_sum / 8, lat_max); 
+	}
+	BUG_ON(set_sched_tick_hz(SCHED_TICK_HZ_MAX + 1) != -1); 
+	set_sched_tick_hz(hz0); 
 }
 
 ///////////////////
@@ -113,8 +395,7 @@ void test_fb() {
     //     for (x=0;x<2*N;x++)
     //         setpixel(the_fb.fb,x,y,pitch,b);             
 
-    //what if we dont flush cache?
-    __asm_flush_dcache_range(the_fb.fb, the_fb.fb + the_fb.size); 
+    // no cache flush: the fb is mapped write-combining, cf do_fb_init()
 
     while (1) {
         fb_set_voffsets(0,0);
@@ -197,76 +478,12 @@ void test_kern_task_mgmt(void) {
 }
 
 ////////////////////////////////////////////////
-// test kernel task sleep(), wakeup()
-// a toy version of reader/writer pipe
-// cf pipe.c 
+// test kernel pipe: a writer and a reader task. cf pipe.c 
 // Q9: quest: "wordsmith"
 
-#define NSIZE 32
-static struct spinlock testlock = {.locked=0, .cpu=0, .name="testlock"};
-static char pipebuf[NSIZE];
-static int nwrite=0, nread=0; 
-
-// write n chars from "str" to pipebuf. block if buf is full
-static void do_write(const char *str, int n) {
-    int i = 0; 
-    acquire(&testlock); 
-
-    while (i < n) {
-        if (nwrite == nread + NSIZE) {   // buffer full
-            sleep(&nwrite, &testlock);
-        } else {
-            pipebuf[nwrite % NSIZE] = str[i];
-            nwrite++;
-            i++;
-            wakeup(&nread);              // wake reader
-        }
-    }
-
-    wakeup(&nread);                      // final wake
-    release(&testlock); 
-}
-
-// read chars from pipebuf to "str". block if buf is empty at the beginning
-// char: buf for receiving chars
-// n: read at most n chars. 
-// return: # of chars actually read
-static int do_read(char *str, int n) {
-    int i; 
+static struct pipe *testpipe; 
 
-    acquire(&testlock); 
-
-    while (nread == nwrite) {   // buffer empty
-        sleep(&nread, &testlock);
-    }
-
-    for (i = 0; i < n; i++) {
-
-        if (nread == nwrite)    // nothing left
-            break;
-
-        str[i] = pipebuf[nread % NSIZE];
-        nread++;
-    }
-
-    wakeup(&nwrite);            // wake writer
-    release(&testlock); 
-    return i; 
-}
 static void task_writer() {
-    // const char *str16="Sky is so clear.";
-    // const char *str32="Learning new things expands our minds.";
-    // const char *str64="The sunset painted the sky with hues of orange, pink, and gold.";
-    
-    // while (1) {
-    //     do_write(str16, strlen(str16)); // NB: strlen does NOT count '\0'
-    //     ms_delay(100); // spin waiting (silly). for testing only
-    //     do_write(str32, strlen(str32));
-    //     ms_delay(100); // spin waiting (silly). for testing only
-    //     do_write(str64, strlen(str64));
-    //     ms_delay(100); // spin waiting (silly). for testing only
-    // }
-
     // around 256 bytes    
     static const char wordsworth[] = "O Nature! Thou art ever kind and free,"
                     "Thy gentle whispers calm the restless soul;"
@@ -274,7 +491,9 @@ static void task_writer() {
                     "In thee, we find our being's truest goal.";
 
     while (1) {
-        do_write(wordsworth, strlen(wordsworth)); // NB: strlen does NOT count '\0'
+        // NB: strlen does NOT count '\0'
+        int n = pipe_write(testpipe, wordsworth, strlen(wordsworth)); 
+        BUG_ON(n != strlen(wordsworth)); 
         ms_delay(100); // spin waiting (silly). for testing only
     }
 }
@@ -284,13 +503,23 @@ static void task_reader() {
     char mybuf[MYBUFLEN];
     int n; 
     while (1) {
-        n = do_read(mybuf, MYBUFLEN-1); // need one char for '\0'
+        n = pipe_read(testpipe, mybuf, MYBUFLEN-1); // need one char for '\0'
+        BUG_ON(n <= 0); 
         mybuf[n] = '\0';
         W("read: %d bytes. %s", n, mybuf);
     }
 }
 
 void test_kern_reader_writer() {
+    // a small buffer so that the writer often blocks 
+    testpipe = pipe_alloc(32);
+    BUG_ON(!testpipe); 
+
+    // empty pipe: non-blocking & timed reads must give up 
+    char c; 
+    BUG_ON(pipe_read_nb(testpipe, &c, 1) != -1); 
+    BUG_ON(pipe_read_timeout(testpipe, &c, 1, 100) != -1); 
+
 	int res = copy_process(PF_KTHREAD, (unsigned long)&task_writer, 
 		0 /*arg*/, "writer");         
 	BUG_ON(res<0); 
@@ -300,6 +529,512 @@ void test_kern_reader_writer() {
 	BUG_ON(res<0);    
 }
 
+////////////////////////////////////////////////
+// test semaphore, completion: batched wakeup, timeout. cf sync.c 
+
+#define SYNC_BATCH  8 
+static struct semaphore items; 
+static struct completion sync_done; 
+
+// consumer: take items one by one, then report back
+static void task_sync_consumer(int id) {
+    int n = 0; 
+    while (sema_down_timeout(&items, 500) == 0)  // no more items: time out 
+        n++; 
+    I("consumer %d: took %d items, timed out", id, n); 
+    complete(&sync_done); 
+    exit_process(0); 
+}
+
+void test_kern_sync(void) {
+    int res; 
+
+    sema_init(&items, 0, "items"); 
+    init_completion(&sync_done, "sync_done"); 
+
+    // nobody will signal: must time out 
+    BUG_ON(wait_for_completion_timeout(&sync_done, 100) == 0);
+    BUG_ON(sema_trydown(&items) == 0); 
+
+    for (int i = 0; i < 2; i++) {
+        res = copy_process(PF_KTHREAD, (unsigned long)&task_sync_consumer, 
+            i /*arg*/, "consumer"); 
+        BUG_ON(res<0); 
+    }
+
+    // producer: one wakeup per batch, waking up to SYNC_BATCH consumers
+    for (int i = 0; i < 4; i++) {
+        sema_up_n(&items, SYNC_BATCH); 
+        ms_delay(50); 
+    }
+
+    wait_for_completion(&sync_done); 
+    wait_for_completion(&sync_done); 
+    I("both consumers done. items left %d (should be 0)", items.count); 
+    BUG_ON(items.count != 0); 
+    for (int i = 0; i < 2; i++)     // reap them: no zombies left 
+        BUG_ON(wait(0) < 0); 
+}
+
+////////////////////////////////////////////////
+// test lock-free rings: SPSC and MPSC, bulk enqueue/dequeue. cf ring.c
+// producers push sequence numbers (tagged w/ producer id); the consumer 
+// checks that each producer's numbers arrive in order and none is lost
+
+#define RING_NELEMS     64      // power of 2 
+#define RING_NITEMS     20000   // per producer 
+#define RING_BURST      16
+static unsigned long ringbuf[RING_NELEMS]; 
+static struct ring ringq; 
+static int ring_mp;     // 1: MPSC 
+
+static void task_ring_producer(int id) {
+    unsigned long v[RING_BURST]; 
+    unsigned long seq = 0; 
+    unsigned k, n; 
+
+    while (seq < RING_NITEMS) {
+        n = MIN(RING_BURST, RING_NITEMS - seq); 
+        for (k = 0; k < n; k++)
+            v[k] = ((unsigned long)id << 32) | (seq + k); 
+        k = ring_mp ? mpsc_enqueue(&ringq, v, n) 
+                    : spsc_enqueue(&ringq, v, n); 
+        seq += k; 
+        if (!k) 
+            yield();    // full 
+    }
+    exit_process(0); 
+}
+
+static void ring_consume(int nproducers) {
+    unsigned long v[RING_BURST], next[2] = {0, 0}; 
+    unsigned long total = 0; 
+    unsigned k; 
+
+    while (total < (unsigned long)nproducers * RING_NITEMS) {
+        k = ring_mp ? mpsc_dequeue(&ringq, v, RING_BURST) 
+                    : spsc_dequeue(&ringq, v, RING_BURST); 
+        if (!k) 
+            {yield(); continue;}    // empty 
+        for (unsigned i = 0; i < k; i++) {
+            unsigned id = v[i] >> 32; 
+            BUG_ON(id >= 2 || (v[i] & 0xffffffff) != next[id]); 
+            next[id]++; 
+        }
+        total += k; 
+    }
+    I("%s ring: %lu items ok", ring_mp ? "mpsc" : "spsc", total); 
+}
+
+void test_ring(void) {
+    int res; 
+
+    // spsc: 1 producer  
+    ring_mp = 0; 
+    BUG_ON(ring_init(&ringq, ringbuf, RING_NELEMS, sizeof(ringbuf[0]))); 
+    res = copy_process(PF_KTHREAD, (unsigned long)&task_ring_producer, 
+        0 /*arg*/, "spsc-prod"); 
+    BUG_ON(res<0); 
+    ring_consume(1); 
+    BUG_ON(wait(0) < 0); 
+
+    // mpsc: 2 producers 
+    ring_mp = 1; 
+    BUG_ON(ring_init(&ringq, ringbuf, RING_NELEMS, sizeof(ringbuf[0]))); 
+    for (int i = 0; i < 2; i++) {
+        res = copy_process(PF_KTHREAD, (unsigned long)&task_ring_producer, 
+            i /*arg*/, "mpsc-prod"); 
+        BUG_ON(res<0); 
+    }
+    ring_consume(2); 
+    BUG_ON(ring_count(&ringq)); 
+    for (int i = 0; i < 2; i++)     // reap the producers 
+        BUG_ON(wait(0) < 0); 
+}
+
+////////////////////////////////////////////////
+// test msg channels: a two-stage pipeline passing whole pages. cf msgchan.c
+// the producer "renders" into pages and donates them; the consumer (us) 
+// checks the contents and frees the pages. No copy in between
+
+#define MSG_NPAGES  64 
+static struct msgchan *testchan; 
+
+static void task_msg_producer(int arg) {
+    for (unsigned i = 0; i < MSG_NPAGES; i++) {
+        unsigned long page = get_free_page_nozero();    // we fill it all
+        BUG_ON(!page); 
+        for (unsigned j = 0; j < PAGE_SIZE / sizeof(unsigned); j++)
+            ((unsigned *)page)[j] = i ^ j; 
+        // blocks when the consumer lags behind by "depth" pages
+        BUG_ON(msg_send(testchan, page, PAGE_SIZE, i /*tag*/, MSG_BLOCK)); 
+    }
+    exit_process(0); 
+}
+
+void test_msgchan(void) {
+    unsigned long used0; 
+    struct msg m; 
+    int res; 
+
+    testchan = msgchan_alloc(4); 
+    BUG_ON(!testchan); 
+    /* after the channel's own memory. exact even if idle is mid-way through 
+    zero_pool_refill(): a page in flight to the zero pool is not counted */
+    used0 = nr_pages_used(); 
+    BUG_ON(msg_recv(testchan, &m, MSG_NONBLOCK) == 0);  // empty 
+
+    res = copy_process(PF_KTHREAD, (unsigned long)&task_msg_producer, 
+        0 /*arg*/, "msg-prod"); 
+    BUG_ON(res<0); 
+
+    for (unsigned i = 0; i < MSG_NPAGES; i++) {
+        BUG_ON(msg_recv(testchan, &m, MSG_BLOCK)); 
+        BUG_ON(m.tag != i || m.len != PAGE_SIZE); 
+        for (unsigned j = 0; j < PAGE_SIZE / sizeof(unsigned); j++)
+            BUG_ON(((unsigned *)m.page)[j] != (i ^ j)); 
+        free_page(m.page);  // we own it now 
+    }
+    BUG_ON(wait(0) < 0);    // reap the producer 
+    I("msgchan: %d pages passed. pages used %lu -> %lu", MSG_NPAGES, 
+        used0, nr_pages_used()); 
+    BUG_ON(nr_pages_used() != used0);   // every page donated came back 
+    msgchan_free(testchan); 
+}
+
+////////////////////////////////////////////////
+// test rcu: a reaped task's slot is reclaimed only after a grace period. 
+// cf rcu.c 
+
+static void kern_task_exit_now(int arg) {
+    exit_process(arg); 
+}
+
+void test_rcu(void) {
+    extern unsigned long rcu_gp_completed; // rcu.c
+    unsigned long gp0 = rcu_gp_completed; 
+    int pid, pid1; 
+
+    pid = copy_process(PF_KTHREAD, (unsigned long)&kern_task_exit_now, 
+        0 /*arg*/, "rcu-victim"); 
+    BUG_ON(pid < 0); 
+    BUG_ON(wait(0) != pid); 
+    // reaped, but a lockless reader may still look at it 
+    I("after wait(): slot state %d (should be TASK_DEAD)", task[pid]->state); 
+    procdump(); 
+
+    synchronize_rcu(); 
+    I("after synchronize_rcu(): slot state %d (should be TASK_UNUSED). "
+        "grace periods %lu", task[pid]->state, rcu_gp_completed - gp0); 
+    BUG_ON(task[pid]->state != TASK_UNUSED); 
+
+    // slot is reusable again 
+    pid1 = copy_process(PF_KTHREAD, (unsigned long)&kern_task_exit_now, 
+        0 /*arg*/, "rcu-victim"); 
+    BUG_ON(pid1 < 0); 
+    BUG_ON(wait(0) != pid1); 
+}
+
+////////////////////////////////////////////////
+// test buddy page allocator: blocks of various orders are aligned and 
+// disjoint; once all are freed, buddies coalesce back. cf alloc.c
+
+#define BUDDY_NBLOCKS   16 
+
+void test_buddy(void) {
+    unsigned long blocks[BUDDY_NBLOCKS], pa; 
+    unsigned long used0 = nr_pages_used(); 
+    unsigned order; 
+
+    buddy_dump(); 
+    for (int i = 0; i < BUDDY_NBLOCKS; i++) {
+        order = i % 5; 
+        blocks[i] = pa = alloc_pages(order); 
+        BUG_ON(!pa); 
+        BUG_ON(pa & ((PAGE_SIZE << order) - 1));    // naturally aligned 
+        memset((void *)pa, i, PAGE_SIZE << order);  // must not overlap others
+    }
+    for (int i = 0; i < BUDDY_NBLOCKS; i++) {
+        order = i % 5; 
+        for (unsigned j = 0; j < (PAGE_SIZE << order); j += PAGE_SIZE)
+            BUG_ON(((unsigned char *)blocks[i])[j] != i); 
+    }
+    buddy_dump(); 
+    // free in a different order than allocation 
+    for (int i = BUDDY_NBLOCKS - 1; i >= 0; i -= 2)
+        free_pages(blocks[i], i % 5); 
+    for (int i = BUDDY_NBLOCKS - 2; i >= 0; i -= 2)
+        free_pages(blocks[i], i % 5); 
+    BUG_ON(nr_pages_used() != used0); 
+    BUG_ON(alloc_pages(MAX_ORDER) != 0); 
+
+    // per-cpu page cache: a hot page freed is the next one handed out 
+    pa = get_free_page_nozero(); 
+    free_page(pa); 
+    BUG_ON(get_free_page_nozero() != pa); 
+    free_page_cold(pa); 
+
+    // zero pool: as the idle loop does. pages come out all 0
+    while (zero_pool_refill())
+        ; 
+    pa = get_free_page(); 
+    for (unsigned j = 0; j < PAGE_SIZE / sizeof(unsigned long); j++)
+        BUG_ON(((unsigned long *)pa)[j]); 
+    memset((void *)pa, 0xff, PAGE_SIZE); 
+    free_page(pa); 
+    BUG_ON(pcp_set_watermarks(4, 2, 1) == 0);   // high < low + batch 
+    BUG_ON(pcp_set_watermarks(4, 32, 8)); 
+    buddy_dump(); 
+    // cma: contiguous, not a power of 2 
+    pa = cma_alloc(5 * PAGE_SIZE + 1); 
+    BUG_ON(!pa || (pa & (CACHE_LINE_SIZE - 1))); 
+    memset((void *)pa, 0x5a, 6 * PAGE_SIZE); 
+    cma_free(pa, 5 * PAGE_SIZE + 1); 
+    BUG_ON(nr_pages_used() != used0); 
+
+    drain_all_pages();          // all cached pages back to buddy lists
+    BUG_ON(pcp_set_watermarks(PCP_LOW, PCP_HIGH, PCP_BATCH)); 
+    BUG_ON(nr_pages_used() != used0); 
+    buddy_dump(); 
+    I("buddy: ok. pages used %lu", nr_pages_used()); 
+}
+
+////////////////////////////////////////////////
+// test kmalloc/kfree: all size classes plus a large allocation. objects are
+// cache line aligned and don't overlap; freed objects are reused. cf slab.c
+
+#define SLAB_NOBJS  64 
+
+void test_slab(void) {
+    static void *objs[SLAB_NOBJS]; 
+    static const unsigned long sizes[] = {1, 63, 64, 100, 256, 600, 1024, 5000}; 
+    unsigned long size; 
+    void *p; 
+
+    for (int i = 0; i < SLAB_NOBJS; i++) {
+        size = sizes[i % NELEM(sizes)]; 
+        objs[i] = kmalloc(size); 
+        BUG_ON(!objs[i]); 
+        BUG_ON((unsigned long)objs[i] & (CACHE_LINE_SIZE - 1)); 
+        memset(objs[i], i, size); 
+    }
+    for (int i = 0; i < SLAB_NOBJS; i++) {
+        size = sizes[i % NELEM(sizes)]; 
+        BUG_ON(((unsigned char *)objs[i])[0] != i
+            || ((unsigned char *)objs[i])[size - 1] != i); 
+    }
+    slab_stats(); 
+    for (int i = 0; i < SLAB_NOBJS; i++)
+        kfree(objs[i]); 
+
+    // per-cpu cache is LIFO: the hottest object comes back first 
+    p = kmalloc(128); 
+    kfree(p); 
+    BUG_ON(kmalloc(128) != p); 
+    kfree(p); 
+    BUG_ON(kmalloc(0) != 0); 
+    p = kzalloc(300); 
+    BUG_ON(!p || ((char *)p)[299]); 
+    kfree(p); 
+    slab_stats(); 
+}
+
+// typed cache: the ctor runs once per object, not per alloc; freed objects
+// keep their constructed state. slabs are coloured 
+struct testobj {
+    struct spinlock lock; 
+    int payload; 
+    char pad[256];  // 5 cache lines: 12 per slab, room left for 4 colours
+}; 
+static int testobj_ctors; 
+
+static void testobj_ctor(void *obj) {
+    struct testobj *t = obj; 
+    initlock(&t->lock, "testobj"); 
+    testobj_ctors++; 
+}
+
+void test_kmem_cache(void) {
+    static struct testobj *objs[SLAB_NOBJS]; 
+    struct kmem_cache *c; 
+    unsigned long colours = 0; 
+    int nctors; 
+
+    c = kmem_cache_create("testobj", sizeof(struct testobj), 0, 
+        testobj_ctor, SLAB_COLOUR); 
+    BUG_ON(!c); 
+    for (int i = 0; i < SLAB_NOBJS; i++) {
+        objs[i] = kmem_cache_alloc(c); 
+        BUG_ON(!objs[i]); 
+        // offsets in the page (in cache lines). colouring shifts them per slab
+        colours |= 1UL << (((unsigned long)objs[i] & ~PAGE_MASK) 
+            / CACHE_LINE_SIZE % 64); 
+        objs[i]->payload = i; 
+        acquire(&objs[i]->lock);    // constructed: usable right away
+        release(&objs[i]->lock); 
+    }
+    nctors = testobj_ctors; 
+    BUG_ON(nctors < SLAB_NOBJS); 
+
+    /* colouring: in creation order, slabs' 1st objects are c->align apart, 
+    wrapping around after c->colour slabs. creation order is c->full from 
+    its tail: each slab became full before the next one was grown (nothing 
+    freed yet). a slab's colour is found from any of its objects we hold */
+    BUG_ON(c->colour < 2); 
+    int prev = -1, nslabs = 0; 
+    for (struct list_head *l = c->full.prev; l != &c->full; l = l->prev) {
+        unsigned long page = (unsigned long)l;  // slab header: page start 
+        int colour = -1; 
+        for (int i = 0; i < SLAB_NOBJS && colour < 0; i++)
+            if (((unsigned long)objs[i] & PAGE_MASK) == page)
+                colour = (((unsigned long)objs[i] & ~PAGE_MASK) - c->offset) 
+                    % c->size / c->align; 
+        if (colour < 0) {   // all its objects in the per-cpu cache 
+            prev = prev < 0 ? -1 : (prev + 1) % c->colour; 
+            continue; 
+        }
+        BUG_ON(colour >= c->colour); 
+        BUG_ON(prev >= 0 && colour != (prev + 1) % c->colour); 
+        prev = colour; 
+        nslabs++; 
+    }
+    BUG_ON(nslabs <= c->colour);    // wrapped around at least once 
+
+    for (int i = 0; i < SLAB_NOBJS; i++)
+        kmem_cache_free(c, objs[i]); 
+    for (int i = 0; i < SLAB_NOBJS; i++)    // reused, not re-constructed 
+        objs[i] = kmem_cache_alloc(c); 
+    BUG_ON(testobj_ctors != nctors); 
+
+    slab_stats(); 
+    BUG_ON(kmem_cache_destroy(c) == 0);     // objects still out 
+    for (int i = 0; i < SLAB_NOBJS; i++)
+        kmem_cache_free(c, objs[i]); 
+    BUG_ON(kmem_cache_destroy(c)); 
+    I("kmem_cache: ok. object offsets seen (in cache lines) %lx", colours); 
+}
+
+////////////////////////////////////////////////
+// test address spaces & ASIDs. cf mm.c 
+// two tasks, each in its own mm, see different values at the same user va 
+// across context switches (no TLB flush in between). then enough short lived
+// mms to roll the ASID generation over: a stale TLB entry would show up as 
+// a wrong value
+
+#define ASID_NMMS   600     // > 2x # of ASIDs
+
+static void task_asid(int val) {
+    struct mm_struct *mm = mm_alloc(); 
+    volatile int *p = (volatile int *)USER_VA_START; 
+    unsigned long page; 
+
+    BUG_ON(!mm); 
+    page = alloc_user_page(mm, USER_VA_START); 
+    BUG_ON(!page); 
+    *(int *)page = val;     // via the kernel's (identity) map
+    use_mm(mm); 
+    mm_release(mm);         // use_mm() holds a ref: the task's
+    for (int i = 0; i < 1000; i++) {
+        BUG_ON(*p != val);  // via the user va
+        yield(); 
+    }
+    exit_process(0);        // releases mm
+}
+
+void test_asid(void) {
+    struct mm_struct *mm; 
+    volatile int *p = (volatile int *)USER_VA_START; 
+    unsigned long page, rollovers = asid_rollovers; 
+    int res; 
+
+    res = copy_process(PF_KTHREAD, (unsigned long)&task_asid, 1, "asid-1"); 
+    BUG_ON(res < 0); 
+    res = copy_process(PF_KTHREAD, (unsigned long)&task_asid, 2, "asid-2"); 
+    BUG_ON(res < 0); 
+
+    for (int i = 0; i < ASID_NMMS; i++) {
+        mm = mm_alloc(); BUG_ON(!mm); 
+        page = alloc_user_page(mm, USER_VA_START); BUG_ON(!page); 
+        *(int *)page = 100 + i; 
+        use_mm(mm); 
+        BUG_ON(*p != 100 + i); 
+        if (i % 50 == 0)
+            yield(); 
+        unuse_mm(mm); 
+        mm_release(mm);     // the last ref: tables & pages freed
+    }
+    BUG_ON(wait(0) < 0);    // reap both children 
+    BUG_ON(wait(0) < 0); 
+    BUG_ON(asid_rollovers - rollovers < 2); 
+    I("asid: ok. %lu rollovers", asid_rollovers - rollovers); 
+}
+
+////////////////////////////////////////////////
+// page colouring benchmark. cf alloc.c 
+// a hot working set is swept over and over, with a large streaming buffer
+// (another task's, say) swept in between. uncoloured, both spread over all
+// L2 sets and the stream evicts the hot set every round. with disjoint 
+// colours the hot set keeps its half of L2 and the stream thrashes only 
+// the other half. NB: qemu does not model caches: expect no difference there
+
+#define CB_HOT_PAGES        48      // 192KB: fits in half of L2
+#define CB_STREAM_PAGES     256     // 1MB: 2x L2
+#define CB_ROUNDS           100
+
+static unsigned long cb_hot[CB_HOT_PAGES], cb_stream[CB_STREAM_PAGES]; 
+
+static void cb_sweep(unsigned long *pages, int n, unsigned long *sum) {
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < PAGE_SIZE; j += CACHE_LINE_SIZE)
+            *sum += *(volatile unsigned long *)(pages[i] + j); 
+}
+
+/* return ms taken */
+static unsigned long cb_run(unsigned hot_mask, unsigned stream_mask) {
+    struct task_struct *p = myproc(); 
+    unsigned long t0, t1, sum = 0; 
+
+    set_task_colours(p, hot_mask); 
+    for (int i = 0; i < CB_HOT_PAGES; i++) {
+        cb_hot[i] = get_free_page_nozero(); BUG_ON(!cb_hot[i]); 
+        BUG_ON(hot_mask && !(hot_mask & (1U << page_colour(cb_hot[i])))); 
+    }
+    set_task_colours(p, stream_mask); 
+    for (int i = 0; i < CB_STREAM_PAGES; i++) {
+        cb_stream[i] = get_free_page_nozero(); BUG_ON(!cb_stream[i]); 
+        BUG_ON(stream_mask && !(stream_mask & (1U << page_colour(cb_stream[i])))); 
+    }
+    set_task_colours(p, 0); 
+
+    t0 = current_time_ms(); 
+    for (int r = 0; r < CB_ROUNDS; r++) {
+        cb_sweep(cb_hot, CB_HOT_PAGES, &sum); 
+        cb_sweep(cb_hot, CB_HOT_PAGES, &sum); 
+        cb_sweep(cb_stream, CB_STREAM_PAGES, &sum); 
+    }
+    t1 = current_time_ms(); 
+
+    for (int i = 0; i < CB_HOT_PAGES; i++)
+        free_page(cb_hot[i]); 
+    for (int i = 0; i < CB_STREAM_PAGES; i++)
+        free_page(cb_stream[i]); 
+    return t1 - t0; 
+}
+
+void test_page_colouring(void) {
+    unsigned long used = nr_pages_used(), plain, coloured; 
+
+    set_page_colouring(0); 
+    plain = cb_run(0, 0); 
+    set_page_colouring(1); 
+    coloured = cb_run(0x0f, 0xf0);     // half of L2 each
+    buddy_dump(); 
+    set_page_colouring(0); 
+    BUG_ON(nr_pages_used() != used); 
+    I("page colouring: uncoloured %lu ms, coloured %lu ms (%d rounds)", 
+        plain, coloured, CB_ROUNDS); 
+}
+
 ////////////////////////////////////////////////
 //  N kernel tasks drawing N donuts
 //  stress test for scheduler and context switch (also more eye candy)
@@ -7,6 +7,7 @@
 #include "printf.h"
 struct spinlock; 
 struct task_struct; 
+struct mm_struct; 
 struct fb_struct; 
 
 // ------------------- utils.S ----------------------------- //
@@ -34,25 +35,35 @@ int             uartgetc(void);
 // ------------------- timer ----------------------------- //
 /* These are for "System Timer". See timer.c for details */
 void sys_timer_init ( void );
-void sys_timer_irq ( void );
+void generic_vtimer_init(void); 
+void generic_vtimer_irq(void); 
 
-// both busy spinning
+// all busy spinning
 void ms_delay(unsigned ms); 
 void us_delay(unsigned us);
+void ns_delay(unsigned ns);
 
 void current_time(unsigned *sec, unsigned *msec);
+unsigned long current_time_ms(void);
+unsigned long ktime_get_ns(void);
+unsigned long ktime_get_us(void);
 
 // kernel timers w/ callbacks, atop sys timer
-typedef unsigned long TKernelTimerHandle;	// =idx in kernel table for timers 
+typedef long TKernelTimerHandle;	// >0. opaque, cf timer.c
 typedef void TKernelTimerHandler (TKernelTimerHandle hTimer, void *pParam, void *pContext);
 
-int ktimer_start(unsigned delayms, TKernelTimerHandler *handler, 
+long ktimer_start(unsigned delayms, TKernelTimerHandler *handler, 
 		void *para, void *context); 
-int ktimer_cancel(int timerid);
+long ktimer_start_range(unsigned delayms, unsigned slackms, 
+		TKernelTimerHandler *handler, void *para, void *context); 
+int ktimer_cancel(long timer);
+void ktimer_stats(unsigned long *irqs, unsigned long *saved);
 
 /* below are for Arm generic timers */
 void generic_timer_init ( void );
 void handle_generic_timer_irq ( void );
+int set_sched_tick_hz(unsigned hz); 
+extern unsigned sched_tick_hz; 
 
 extern unsigned int ticks; 
 
@@ -67,8 +78,66 @@ void            pop_off(void);
 // ------------------- sched ---------------------------- //
 void exit_process(int);
 void sleep(void *, struct spinlock *);
+int sleep_timeout(void *chan, struct spinlock *lk, unsigned ms);
 int wait(uint64_t);
 int wakeup(void *);
+int wakeup_n(void *chan, int n);
+
+// ------------------- sync ---------------------------- //
+struct semaphore; 
+struct completion; 
+struct condvar; 
+void sema_init(struct semaphore *s, int count, char *name); 
+void sema_down(struct semaphore *s); 
+int sema_down_timeout(struct semaphore *s, unsigned ms); 
+int sema_trydown(struct semaphore *s); 
+void sema_up(struct semaphore *s); 
+void sema_up_n(struct semaphore *s, int n); 
+
+void init_completion(struct completion *c, char *name); 
+void reinit_completion(struct completion *c); 
+void wait_for_completion(struct completion *c); 
+int wait_for_completion_timeout(struct completion *c, unsigned ms); 
+void complete(struct completion *c); 
+void complete_n(struct completion *c, int n); 
+void complete_all(struct completion *c); 
+
+void cv_init(struct condvar *cv, char *name); 
+void cv_wait(struct condvar *cv, struct spinlock *lk); 
+int cv_wait_timeout(struct condvar *cv, struct spinlock *lk, unsigned ms); 
+int cv_signal(struct condvar *cv); 
+int cv_signal_n(struct condvar *cv, int n); 
+int cv_broadcast(struct condvar *cv); 
+
+// ------------------- pipe ---------------------------- //
+struct pipe; 
+struct pipe *pipe_alloc(unsigned size); 
+void pipe_close(struct pipe *pi, int writable); 
+int pipe_write(struct pipe *pi, const char *buf, int n); 
+int pipe_write_nb(struct pipe *pi, const char *buf, int n); 
+int pipe_write_timeout(struct pipe *pi, const char *buf, int n, int timeout); 
+int pipe_read(struct pipe *pi, char *buf, int n); 
+int pipe_read_nb(struct pipe *pi, char *buf, int n); 
+int pipe_read_timeout(struct pipe *pi, char *buf, int n, int timeout); 
+void pipe_init(void); 
+
+// ------------------- msgchan ---------------------------- //
+struct msgchan; 
+struct msg; 
+struct msgchan *msgchan_alloc(unsigned depth); 
+void msgchan_free(struct msgchan *ch); 
+int msg_send(struct msgchan *ch, unsigned long page, unsigned len, 
+    unsigned tag, int timeout); 
+int msg_recv(struct msgchan *ch, struct msg *m, int timeout); 
+unsigned msg_pending(struct msgchan *ch); 
+void msgchan_init(void); 
+
+// ------------------- rcu ---------------------------- //
+struct rcu_head; 
+void rcu_qs(void); 
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *)); 
+void rcu_check_callbacks(void); 
+void synchronize_rcu(void); 
 
 // ------------------- irq ---------------------------- //
 void enable_interrupt_controller(int coreid); // irq.c 
@@ -85,16 +154,69 @@ int cpuid(void);  // util.S must be called with irq disabled
 // alloc.c 
 unsigned int paging_init();
 unsigned long get_free_page();      // pa
+unsigned long get_free_page_nozero(void);   // pa. contents undefined
+int zero_pool_refill(void); 
 void free_page(unsigned long p);    // pa 
+unsigned long alloc_pages(unsigned order);          // pa. 2^order pages, not zeroed
+void free_pages(unsigned long p, unsigned order);   // pa 
+void free_page_cold(unsigned long p);   // pa
+void drain_all_pages(void); 
+int pcp_set_watermarks(int low, int high, int batch); 
+unsigned long nr_pages_used(void); 
+void set_page_colouring(int on); 
+void set_task_colours(struct task_struct *p, unsigned mask); 
+unsigned page_colour(unsigned long pa); 
+void buddy_dump(void); 
 int reserve_phys_region(unsigned long pa_start, unsigned long size); 
 int free_phys_region(unsigned long pa_start, unsigned long size); 
+unsigned long cma_alloc(unsigned long size);    // pa. physically contiguous
+void cma_free(unsigned long pa, unsigned long size); 
+int cma_claim(unsigned long pa, unsigned long size); 
+int cma_release(unsigned long pa, unsigned long size); 
+
+// slab.c 
+struct kmem_cache; 
+void kmem_init(unsigned long base, unsigned long npages); 
+struct kmem_cache *kmem_cache_create(const char *name, unsigned size, 
+    unsigned align, void (*ctor)(void *), unsigned flags); 
+int kmem_cache_destroy(struct kmem_cache *c); 
+void *kmem_cache_alloc(struct kmem_cache *c); 
+void kmem_cache_free(struct kmem_cache *c, void *obj); 
+void *kmalloc(unsigned long size);    // cache line aligned, not zeroed
+void *kzalloc(unsigned long size); 
+void kfree(void *p); 
+void slab_stats(void); 
 
 // ----------------  mm.c ---------------------- //
+void mmu_init(void); 
+void enable_mmu(unsigned long pgd);     // boot.S
+void set_pgd(unsigned long ttbr);       // utils.S
+int set_memory_wc(unsigned long pa, unsigned long size); 
+int set_memory_wb(unsigned long pa, unsigned long size); 
+void mm_init(void); 
+void switch_mm(struct mm_struct *mm); 
+struct mm_struct *mm_alloc(void); 
+int map_user_page(struct mm_struct *mm, unsigned long va, unsigned long pa); 
+unsigned long alloc_user_page(struct mm_struct *mm, unsigned long va); 
+void mm_release(struct mm_struct *mm); 
+void use_mm(struct mm_struct *mm); 
+void unuse_mm(struct mm_struct *mm); 
+extern unsigned long asid_rollovers; 
 //src/n must be 8 bytes aligned   util.S
 void memzero_aligned(void *src, unsigned long n);  
 //dst/src/n must be 8 bytes aligned    util.S
 void* memcpy_aligned(void* dst, const void* src, unsigned int n);
 
+// ring.c 
+struct ring; 
+int ring_init(struct ring *r, void *data, unsigned nelems, unsigned esize); 
+unsigned ring_count(struct ring *r); 
+unsigned ring_free_count(struct ring *r); 
+unsigned spsc_enqueue(struct ring *r, const void *src, unsigned n); 
+unsigned spsc_dequeue(struct ring *r, void *dst, unsigned n); 
+unsigned mpsc_enqueue(struct ring *r, const void *src, unsigned n); 
+unsigned mpsc_dequeue(struct ring *r, void *dst, unsigned n); 
+
 // string.c
 int memcmp(const void *, const void *, uint);
 void *memmove(void *, const void *, uint);
@@ -138,6 +260,9 @@ int fb_set_voffsets(int offsetx, int offsety);
 #define likely(exp)     __builtin_expect (!!(exp), 1)
 #define unlikely(exp)   __builtin_expect (!!(exp), 0)
 
+// keep a var/member on its own cache line, e.g. to avoid false sharing
+#define __cacheline_aligned   __attribute__((aligned(CACHE_LINE_SIZE)))
+
 #define container_of(ptr, type, member) ({                      \
         const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
         (type *)((char *)__mptr - __builtin_offsetof(type,member));})